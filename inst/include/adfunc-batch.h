@@ -0,0 +1,159 @@
+
+
+#ifndef ___ADFUNC_BATCH_H___
+#define ___ADFUNC_BATCH_H___
+
+#include "cppad.eigen.h"
+#include "adfunc.h"
+#include <vector>
+
+
+// evaluate f and its derivatives at many points using a single tape. Each column of points is a
+// point flattened as by adfunc_flatten, with shapes giving the matrices that make up a point.
+// ys are the values of f at the first point (their shapes give the layout of each column of values).
+// The results are written into values (m x N), jacobians (m x nN, the jacobian for point p in the
+// columns pn to (p+1)n-1) and hessians (n x nmN, the m hessians for point p stacked in the
+// columns pnm to (p+1)nm-1). They are only resized when their shapes differ from the required ones
+// so preallocated arrays are filled in place. The tape is recorded at the first point and recorded
+// again whenever a comparison takes a different branch at a later point. The tape is optimized
+// according to optimize, and if size is given the size of the (last) tape is returned in it.
+template <class T1,class T2>
+void adfunc_batch(const FUNCTION(T2)& f,const MULTIARG(T1)& shapes,const MATRIX(T1)& points,
+		  MULTIARG(T1)& ys,MATRIX(T1)& values,MATRIX(T1)& jacobians,MATRIX(T1)& hessians,
+		  unsigned int order = 2,ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO,
+		  const ADOptimize& optimize = ADOptimize(),ADTapeSize* size = 0)
+{
+  unsigned int xs_AD_vec_size = points.rows();
+  unsigned int num_points = points.cols();
+
+  CppAD::ADFun<T1> f_tape;
+  MULTIARG(T2) a_ys;
+  MULTIARG(T1) xs;
+  std::vector<T1> eval_point(xs_AD_vec_size);
+  std::vector<T1> y;
+  MATRIX(T1) jacobian;
+  TENSOR(T1) hessian;
+  ADTapeSize tape_size;
+  unsigned int reuses = 0;
+  for(unsigned int p = 0; p < num_points; p++)
+    {
+      Eigen::Map<MATRIX(T1)>(eval_point.data(),xs_AD_vec_size,1) = points.col(p);
+      // the zero order sweep for the value is shared with the derivatives
+      bool swept = false;
+      if(p > 0)
+	{
+	  adfunc_optimize(f_tape,optimize,++reuses,tape_size);
+	  y = f_tape.Forward(0,eval_point);
+	  swept = true;
+	}
+      if(p == 0 || f_tape.compare_change_number() > 0)
+	{
+	  // (re)record the tape at this point
+	  adfunc_unflatten(eval_point,shapes,xs);
+	  adfunc_record(f,xs,f_tape,a_ys);
+	  swept = false;
+	  adfunc_tape_size(f_tape,tape_size);
+	  reuses = 0;
+	  adfunc_optimize(f_tape,optimize,reuses,tape_size);
+	  MULTIARG(T1) ys_p(a_ys.size());
+	  for(unsigned int i = 0; i < a_ys.size(); i++)
+	    {
+	      ys_p[i] = Convert<MATRIX(T1)>(a_ys[i]);
+	    }
+	  adfunc_flatten(ys_p,y);
+	  if(p == 0)
+	    {
+	      ys = ys_p;
+	    }
+	}
+      unsigned int a_ys_AD_vec_size = y.size();
+      if(p == 0)
+	{
+	  // now that the size of the range is known
+	  unsigned int num_jacobian_cols = order > 0 ? xs_AD_vec_size*num_points : 0;
+	  unsigned int num_hessian_cols = order > 1 ? xs_AD_vec_size*a_ys_AD_vec_size*num_points : 0;
+	  if(values.rows() != a_ys_AD_vec_size || values.cols() != num_points)
+	    {
+	      values.resize(a_ys_AD_vec_size,num_points);
+	    }
+	  if(jacobians.rows() != a_ys_AD_vec_size || jacobians.cols() != num_jacobian_cols)
+	    {
+	      jacobians.resize(a_ys_AD_vec_size,num_jacobian_cols);
+	    }
+	  if(hessians.rows() != xs_AD_vec_size || hessians.cols() != num_hessian_cols)
+	    {
+	      hessians.resize(xs_AD_vec_size,num_hessian_cols);
+	    }
+	}
+      values.col(p) = Eigen::Map<const MATRIX(T1)>(y.data(),a_ys_AD_vec_size,1);
+      if(order == 0)
+	{
+	  continue;
+	}
+      adfunc_derivatives(f_tape,eval_point,jacobian,hessian,order,mode,swept);
+      jacobians.block(0,p*xs_AD_vec_size,a_ys_AD_vec_size,xs_AD_vec_size) = jacobian;
+      for(unsigned int d = 0; d < hessian.cols(); d++)
+	{
+	  hessians.block(0,(p*a_ys_AD_vec_size+d)*xs_AD_vec_size,xs_AD_vec_size,xs_AD_vec_size) = hessian(0,d);
+	}
+    }
+  if(size != 0)
+    {
+      *size = tape_size;
+    }
+}
+
+
+// as above, for points given as a vector of MULTIARGs (which must all have the same shapes)
+template <class T1,class T2>
+MULTITRIPLE(T1) adfunc_batch(const FUNCTION(T2)& f,const MULTIMULTIARG(T1)& xss,
+			     unsigned int order = 2,ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO,
+			     const ADOptimize& optimize = ADOptimize(),ADTapeSize* size = 0)
+{
+  unsigned int num_points = xss.size();
+  MULTITRIPLE(T1) results(num_points);
+  if(num_points == 0)
+    {
+      return results;
+    }
+  // stack the points
+  std::vector<T1> eval_point;
+  adfunc_flatten(xss[0],eval_point);
+  unsigned int xs_AD_vec_size = eval_point.size();
+  MATRIX(T1) points(xs_AD_vec_size,num_points);
+  for(unsigned int p = 0; p < num_points; p++)
+    {
+      adfunc_flatten(xss[p],eval_point);
+      points.col(p) = Eigen::Map<const MATRIX(T1)>(eval_point.data(),xs_AD_vec_size,1);
+    }
+  MULTIARG(T1) ys;
+  MATRIX(T1) values;
+  MATRIX(T1) jacobians;
+  MATRIX(T1) hessians;
+  adfunc_batch(f,xss[0],points,ys,values,jacobians,hessians,order,mode,optimize,size);
+  // unstack the results
+  unsigned int a_ys_AD_vec_size = values.rows();
+  std::vector<T1> y(a_ys_AD_vec_size);
+  for(unsigned int p = 0; p < num_points; p++)
+    {
+      Eigen::Map<MATRIX(T1)>(y.data(),a_ys_AD_vec_size,1) = values.col(p);
+      adfunc_unflatten(y,ys,boost::get<0>(results[p]));
+      if(order > 0)
+	{
+	  boost::get<1>(results[p]) = jacobians.block(0,p*xs_AD_vec_size,a_ys_AD_vec_size,xs_AD_vec_size);
+	}
+      if(order > 1)
+	{
+	  TENSOR(T1) hessian(1,a_ys_AD_vec_size);
+	  for(unsigned int d = 0; d < a_ys_AD_vec_size; d++)
+	    {
+	      hessian(0,d) = hessians.block(0,(p*a_ys_AD_vec_size+d)*xs_AD_vec_size,xs_AD_vec_size,xs_AD_vec_size);
+	    }
+	  boost::get<2>(results[p]) = hessian;
+	}
+    }
+  return results;
+}
+
+
+#endif
@@ -0,0 +1,278 @@
+
+
+#ifndef ___ADFUNC_CACHE_H___
+#define ___ADFUNC_CACHE_H___
+
+#include "cppad.eigen.h"
+#include "adfunc.h"
+#include "adfunc-product.h"
+#include <vector>
+#include <map>
+#include <utility>
+#include <boost/shared_ptr.hpp>
+
+
+// constants of f, ie the matrices of T that f uses as they are (eg large data sets declared as matrices of
+// double), referred to rather than copied
+#define CONSTANTS(T) std::vector<Eigen::Ref<const MATRIX(T)> >
+
+
+// a tape recorded by adfunc along with the results of f at the point of recording
+// (the results are only used for their shapes when unwrapping later sweeps), the number
+// of times it has been reused, its size, the number of elements of its domain that are data and the values
+// of the constants of f it was recorded with
+template <class T1>
+class ADTape
+{
+public:
+  ADTape() : reuses(0), num_dynamic(0) {}
+
+  CppAD::ADFun<T1> f_tape;
+  MULTIARG(T1) ys;
+  unsigned int reuses;
+  ADTapeSize size;
+  unsigned int num_dynamic;
+  MULTIARG(T1) cs;
+};
+
+
+// the identity of f - only available when f wraps a plain function pointer, otherwise 0
+template <class T2>
+const void* adfunc_identity(const FUNCTION(T2)& f)
+{
+  typedef MULTIARG(T2) (*Function_Pointer_Type)(const MULTIARG(T2)&);
+  const Function_Pointer_Type* fp = f.template target<Function_Pointer_Type>();
+  if(fp == 0)
+    {
+      return 0;
+    }
+  return reinterpret_cast<const void*>(*fp);
+}
+
+
+// cache of tapes keyed by the identity of the function and the dimensions of each matrix in xs and in the
+// constants cs of f.
+// the first call for a key records the tape, later calls only sweep the stored tape. If a
+// comparison operator takes a different branch at the new point then the tape is recorded again.
+// Tapes are optimized according to the optimize policy of the cache. Data ps (see adfunc) are
+// part of the domain of the tape so a tape is reused when only the values of the data change. Constants are
+// part of the recording, so a tape is only reused for the values of the constants it was recorded with.
+// NB - not thread safe, use one cache per thread
+template <class T1,class T2>
+class ADFunCache
+{
+public:
+  typedef std::vector<std::pair<unsigned int,unsigned int> > Shape_Type;
+  typedef std::pair<const void*,Shape_Type> Key_Type;
+  typedef boost::shared_ptr<ADTape<T1> > Tape_Type;
+  typedef std::map<Key_Type,Tape_Type> Tape_Map_Type;
+
+  // return a tape for f with data ps and constants cs, ys are the values of f at xs. The zero order Taylor
+  // coefficients of the tape are those at xs and ps.
+  Tape_Type tape(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,const CONSTANTS(T1)& cs,const void* id,
+		 MULTIARG(T1)& ys)
+  {
+    MULTIARG(T1) xps = adfunc_append(xs,ps);
+    std::vector<T1> eval_point;
+    adfunc_flatten(xps,eval_point);
+    unsigned int num_dynamic = eval_point.size();
+    for(unsigned int i = 0; i < xs.size(); i++)
+      {
+	num_dynamic -= xs[i].size();
+      }
+    Key_Type key = std::make_pair(id,shape(xps,cs));
+    typename Tape_Map_Type::iterator it = m_tapes.find(key);
+    if(it != m_tapes.end() && it->second->num_dynamic == num_dynamic && equal(it->second->cs,cs))
+      {
+	Tape_Type t = it->second;
+	t->reuses++;
+	adfunc_optimize(t->f_tape,m_optimize,t->reuses,t->size);
+	std::vector<T1> y = t->f_tape.Forward(0,eval_point);
+	if(t->f_tape.compare_change_number() == 0)
+	  {
+	    adfunc_unflatten(y,t->ys,ys);
+	    return t;
+	  }
+	// the tape took a different branch - fall through and record again
+      }
+    Tape_Type t(new ADTape<T1>);
+    t->num_dynamic = num_dynamic;
+    t->cs.assign(cs.begin(),cs.end());
+    MULTIARG(T2) a_ys;
+    adfunc_record(f,xps,t->f_tape,a_ys);
+    adfunc_tape_size(t->f_tape,t->size);
+    adfunc_optimize(t->f_tape,m_optimize,t->reuses,t->size);
+    // leave the zero order coefficients at xs and ps on the tape, as for a reused tape
+    t->f_tape.Forward(0,eval_point);
+    unsigned int num_ys = a_ys.size();
+    t->ys.resize(num_ys);
+    for(unsigned int i = 0; i < num_ys; i++)
+      {
+	t->ys[i] = Convert<MATRIX(T1)>(a_ys[i]);
+      }
+    ys = t->ys;
+    m_tapes[key] = t;
+    return t;
+  }
+
+  // as above, where f has no constants
+  Tape_Type tape(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,const void* id,MULTIARG(T1)& ys)
+  {
+    return tape(f,xs,ps,CONSTANTS(T1)(),id,ys);
+  }
+
+  // as above, where f has no data
+  Tape_Type tape(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const void* id,MULTIARG(T1)& ys)
+  {
+    return tape(f,xs,MULTIARG(T1)(),id,ys);
+  }
+
+  TRIPLE(T1) operator()(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,const CONSTANTS(T1)& cs,
+			const void* id,unsigned int order = 2,ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO)
+  {
+    MULTIARG(T1) ys;
+    Tape_Type t = tape(f,xs,ps,cs,id,ys);
+    std::vector<T1> eval_point;
+    adfunc_flatten(adfunc_append(xs,ps),eval_point);
+    MATRIX(T1) jacobian;
+    TENSOR(T1) hessians;
+    adfunc_derivatives(t->f_tape,eval_point,jacobian,hessians,order,mode,true,t->num_dynamic);
+    return boost::make_tuple(ys,jacobian,hessians);
+  }
+
+  TRIPLE(T1) operator()(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,const void* id,
+			unsigned int order = 2,ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO)
+  {
+    return (*this)(f,xs,ps,CONSTANTS(T1)(),id,order,mode);
+  }
+
+  TRIPLE(T1) operator()(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const void* id,unsigned int order = 2,
+			ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO)
+  {
+    return (*this)(f,xs,MULTIARG(T1)(),id,order,mode);
+  }
+
+  void clear() { m_tapes.clear(); }
+  unsigned int size() const { return m_tapes.size(); }
+
+  // the optimize policy applied to the tapes in the cache
+  void optimize(const ADOptimize& optimize) { m_optimize = optimize; }
+  const ADOptimize& optimize() const { return m_optimize; }
+
+  // the tapes in the cache (eg for their sizes before and after optimization)
+  const Tape_Map_Type& tapes() const { return m_tapes; }
+
+private:
+  static Shape_Type shape(const MULTIARG(T1)& xs,const CONSTANTS(T1)& cs)
+  {
+    Shape_Type s(xs.size()+cs.size());
+    for(unsigned int i = 0; i < xs.size(); i++)
+      {
+	s[i] = std::make_pair((unsigned int) xs[i].rows(),(unsigned int) xs[i].cols());
+      }
+    for(unsigned int i = 0; i < cs.size(); i++)
+      {
+	s[xs.size()+i] = std::make_pair((unsigned int) cs[i].rows(),(unsigned int) cs[i].cols());
+      }
+    return s;
+  }
+
+  // whether the constants of a tape have the values cs (their shapes are part of the key)
+  static bool equal(const MULTIARG(T1)& tape_cs,const CONSTANTS(T1)& cs)
+  {
+    for(unsigned int i = 0; i < cs.size(); i++)
+      {
+	if(tape_cs[i] != cs[i])
+	  {
+	    return false;
+	  }
+      }
+    return true;
+  }
+
+  Tape_Map_Type m_tapes;
+  ADOptimize m_optimize;
+};
+
+
+// as adfunc (including data ps, order and mode), but the tape is recorded once per (f, shapes of xs, ps and cs) and
+// reused on later calls, including those with different values of the data. cs are the constants that f uses,
+// eg those it is bound to, and the tape is recorded again when their values change.
+// id identifies f, if it is 0 then the identity of the function pointer wrapped by f is used.
+// If f has no identity the tape is recorded every call, as with adfunc.
+template <class T1,class T2>
+TRIPLE(T1) adfunc_cached(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,const CONSTANTS(T1)& cs,
+			 unsigned int order = 2,ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO,const void* id = 0)
+{
+  if(id == 0)
+    {
+      id = adfunc_identity(f);
+    }
+  if(id == 0)
+    {
+      return adfunc(f,xs,ps,order,mode);
+    }
+  ADFunCache<T1,T2>& cache = CGenericSingleton<ADFunCache<T1,T2> >::Instance();
+  return cache(f,xs,ps,cs,id,order,mode);
+}
+
+
+// as above, where f has no constants
+template <class T1,class T2>
+TRIPLE(T1) adfunc_cached(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,unsigned int order = 2,
+			 ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO,const void* id = 0)
+{
+  return adfunc_cached(f,xs,ps,CONSTANTS(T1)(),order,mode,id);
+}
+
+
+// as above, where f has no data
+template <class T1,class T2>
+TRIPLE(T1) adfunc_cached(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,unsigned int order = 2,
+			 ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO,const void* id = 0)
+{
+  return adfunc_cached(f,xs,MULTIARG(T1)(),order,mode,id);
+}
+
+
+// as adfunc_product, using the tape for f with constants cs from the cache (see adfunc_cached)
+template <class T1,class T2>
+MATRIX(T1) adfunc_cached_product(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,const CONSTANTS(T1)& cs,
+				 const MATRIX(T1)& v,const MATRIX(T1)& w,ADFUNC_PRODUCT product,const void* id = 0)
+{
+  if(id == 0)
+    {
+      id = adfunc_identity(f);
+    }
+  if(id == 0)
+    {
+      return adfunc_product(f,xs,ps,v,w,product);
+    }
+  ADFunCache<T1,T2>& cache = CGenericSingleton<ADFunCache<T1,T2> >::Instance();
+  MULTIARG(T1) ys;
+  typename ADFunCache<T1,T2>::Tape_Type t = cache.tape(f,xs,ps,cs,id,ys);
+  std::vector<T1> eval_point;
+  adfunc_flatten(adfunc_append(xs,ps),eval_point);
+  return adfunc_product(t->f_tape,eval_point,v,w,product,t->num_dynamic);
+}
+
+
+// as above, where f has no constants
+template <class T1,class T2>
+MATRIX(T1) adfunc_cached_product(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,
+				 const MATRIX(T1)& v,const MATRIX(T1)& w,ADFUNC_PRODUCT product,const void* id = 0)
+{
+  return adfunc_cached_product(f,xs,ps,CONSTANTS(T1)(),v,w,product,id);
+}
+
+
+// as above, where f has no data
+template <class T1,class T2>
+MATRIX(T1) adfunc_cached_product(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MATRIX(T1)& v,const MATRIX(T1)& w,
+				 ADFUNC_PRODUCT product,const void* id = 0)
+{
+  return adfunc_cached_product(f,xs,MULTIARG(T1)(),v,w,product,id);
+}
+
+
+#endif
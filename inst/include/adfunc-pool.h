@@ -5,7 +5,8 @@
 #include "cppad.eigen.h"
 #include "adfunc.h"
 #include <vector>
-#include <map>
+#include <algorithm>
+#include <stdexcept>
 #include <omp.h>
 
 
@@ -24,11 +25,37 @@ static size_t thread_number(void)
    return static_cast<size_t>( omp_get_thread_num() ); 
 }
 
+// throw unless the values, jacobian and hessians of B have the shapes of those of A
+template <class T>
+void adfunc_check_shapes(const TRIPLE(T)& A,const TRIPLE(T)& B)
+{
+  const MULTIARG(T)& ys_A = boost::get<0>(A);
+  const MULTIARG(T)& ys_B = boost::get<0>(B);
+  bool compatible = ys_A.size() == ys_B.size();
+  for(unsigned int i = 0; compatible && i < ys_A.size(); i++)
+    {
+      compatible = ys_A[i].rows() == ys_B[i].rows() && ys_A[i].cols() == ys_B[i].cols();
+    }
+  compatible = compatible && boost::get<1>(A).rows() == boost::get<1>(B).rows() && boost::get<1>(A).cols() == boost::get<1>(B).cols();
+  const TENSOR(T)& hessians_A = boost::get<2>(A);
+  const TENSOR(T)& hessians_B = boost::get<2>(B);
+  compatible = compatible && hessians_A.rows() == hessians_B.rows() && hessians_A.cols() == hessians_B.cols();
+  for(unsigned int d = 0; compatible && d < hessians_A.size(); d++)
+    {
+      compatible = hessians_A(d).rows() == hessians_B(d).rows() && hessians_A(d).cols() == hessians_B(d).cols();
+    }
+  if(!compatible)
+    {
+      throw std::invalid_argument("triples must have values, jacobians and hessians of the same shapes to be added");
+    }
+}
+
+
 template <class T>
 TRIPLE(T) operator+(const TRIPLE(T)& A,const TRIPLE(T)& B)
 {
   TRIPLE(T) result;
-  // TODO - throw if triples are incompatible
+  adfunc_check_shapes(A,B);
   // determine number of ys
   unsigned int num_ys = boost::get<0>(A).size();
   // get number of dimensions
@@ -60,6 +87,83 @@ TRIPLE(T) reduce_addition(const TRIPLE(T)& A, const TRIPLE(T)& B)
 
 
 
+// add slot of B to that of A in place - slots 0 to num_ys-1 are the values, slot num_ys is the
+// jacobian and slot num_ys+1+d is the dth hessian
+template <class T>
+void adfunc_add_slot(TRIPLE(T)& A,const TRIPLE(T)& B,unsigned int slot)
+{
+  unsigned int num_ys = boost::get<0>(A).size();
+  if(slot < num_ys)
+    {
+      boost::get<0>(A)[slot] += boost::get<0>(B)[slot];
+    }
+  else if(slot == num_ys)
+    {
+      boost::get<1>(A) += boost::get<1>(B);
+    }
+  else
+    {
+      boost::get<2>(A)(slot-num_ys-1) += boost::get<2>(B)(slot-num_ys-1);
+    }
+}
+
+
+// the sum of triples (which must all have the shapes of the first, otherwise std::invalid_argument is thrown
+// before any are summed) written into result. The triples are
+// summed in place by a binary tree - at each level triple i accumulates triple i+stride for i a multiple
+// of 2*stride - so triples is overwritten. The additions of a level are run in parallel, one task per pair
+// and slot, and as the tree only depends on the number of triples the result is the same for any number
+// of threads. The matrices of result are only reallocated when their shapes differ.
+// num_threads = 0 uses omp_get_max_threads() threads.
+template <class T>
+void adfunc_reduce(MULTITRIPLE(T)& triples,TRIPLE(T)& result,unsigned int num_threads = 0)
+{
+  unsigned int num_triples = triples.size();
+  if(num_triples == 0)
+    {
+      return;
+    }
+  if(num_threads == 0)
+    {
+      num_threads = omp_get_max_threads();
+    }
+  for(unsigned int i = 1; i < num_triples; i++)
+    {
+      adfunc_check_shapes(triples[0],triples[i]);
+    }
+  unsigned int num_ys = boost::get<0>(triples[0]).size();
+  unsigned int num_hessians = boost::get<2>(triples[0]).size();
+  unsigned int num_slots = num_ys + 1 + num_hessians;
+  for(unsigned int stride = 1; stride < num_triples; stride *= 2)
+    {
+      int num_pairs = (num_triples - stride + 2*stride - 1) / (2*stride);
+      int num_tasks = num_pairs*num_slots;
+      # pragma omp parallel for num_threads(num_threads) schedule(dynamic) if(num_tasks > 1)
+      for(int task = 0; task < num_tasks; task++)
+	{
+	  unsigned int i = 2*stride*(task / num_slots);
+	  adfunc_add_slot(triples[i],triples[i+stride],task % num_slots);
+	}
+    }
+  const TRIPLE(T)& sum = triples[0];
+  boost::get<0>(result).resize(num_ys);
+  for(unsigned int i = 0; i < num_ys; i++)
+    {
+      boost::get<0>(result)[i] = boost::get<0>(sum)[i];
+    }
+  boost::get<1>(result) = boost::get<1>(sum);
+  TENSOR(T)& hessians = boost::get<2>(result);
+  if(hessians.rows() != boost::get<2>(sum).rows() || hessians.cols() != boost::get<2>(sum).cols())
+    {
+      hessians.resize(boost::get<2>(sum).rows(),boost::get<2>(sum).cols());
+    }
+  for(unsigned int d = 0; d < num_hessians; d++)
+    {
+      hessians(d) = boost::get<2>(sum)(d);
+    }
+}
+
+
 template <class T>
 TRIPLE(T) wrap_result_in_triple(const FUNCTION(T)& f,const MULTIARG(T)& xs)
 {
@@ -69,72 +173,324 @@ TRIPLE(T) wrap_result_in_triple(const FUNCTION(T)& f,const MULTIARG(T)& xs)
 }
 
 
-// this type of pool takes functions that use ADLA within them. Matlab style
+// the time taken by a task of the pool and the thread that ran it
+class ADTaskTiming
+{
+public:
+  ADTaskTiming() : thread(0), seconds(0.0) {}
+
+  unsigned int thread;
+  double seconds;
+};
+
+
+// set up CppAD for use by num_threads threads with Scalar_Type. This changes global state of CppAD
+// so is only done (in sequential mode) when more threads or a new Scalar_Type are needed. Memory freed
+// by a thread is held in its thread_alloc arena for later use by the same thread.
+template <class Scalar_Type>
+void adfunc_parallel_setup(unsigned int num_threads)
+{
+  static unsigned int num_threads_setup = 0;
+  if(num_threads <= num_threads_setup)
+    {
+      return;
+    }
+  if(thread_alloc::num_threads() < num_threads)
+    {
+      thread_alloc::parallel_setup(num_threads,in_parallel,thread_number);
+    }
+  thread_alloc::hold_memory(true);
+  CppAD::parallel_ad<Scalar_Type>();
+  // the checks of the vector types used by the sweeps have statics that must be set up sequentially
+  CppAD::CheckSimpleVector<Scalar_Type,std::vector<Scalar_Type> >();
+  CppAD::CheckSimpleVector<CppAD::AD<Scalar_Type>,std::vector<CppAD::AD<Scalar_Type> > >();
+  CppAD::CheckSimpleVector<size_t,std::vector<size_t> >();
+  CppAD::CheckSimpleVector<bool,std::vector<bool> >();
+  num_threads_setup = num_threads;
+}
+
+
+// a pool of threads for functions that use ADLA within them. Matlab style
 // argument structure is used ie [y] f([x]) where [y] and [x] are of type MULTIARG 
-// (ie multiple matrices) of type Scalar_Type
+// (ie multiple matrices) of type Scalar_Type.
+// CppAD is set up once when the pool is constructed and the pool then takes any number of batches.
+// The threads are those of the OpenMP runtime, which keeps them between batches, and the OpenMP
+// settings of the process are left unchanged. num_threads = 0 uses omp_get_max_threads() threads.
+// The functions of a batch are handed out one at a time to whichever thread is free, so tasks of very
+// different costs keep all threads busy. Each task records and sweeps its tapes within the thread
+// that runs it. If timings is given the time taken by each task is returned in it.
 template <class Scalar_Type>
-std::vector<TRIPLE(Scalar_Type)> 
-adfunc_pool(const std::vector<boost::function<TRIPLE(Scalar_Type) (const MULTIARG(Scalar_Type)&)> >& fs, 
-            const std::vector<MULTIARG(Scalar_Type)>& xs)
+class ADFunPool
 {
-  // turn off dynamic thread adjustment
-  omp_set_dynamic(0);
+public:
+  typedef boost::function<TRIPLE(Scalar_Type) (const MULTIARG(Scalar_Type)&)> Function_Type;
+
+  ADFunPool(unsigned int num_threads = 0) : m_num_threads(num_threads)
+  {
+    if(m_num_threads == 0)
+      {
+	m_num_threads = omp_get_max_threads();
+      }
+    adfunc_parallel_setup<Scalar_Type>(m_num_threads);
+  }
 
-  unsigned int num_threads = omp_get_max_threads();
-  unsigned int num_fs = fs.size();
-  if(num_fs < num_threads)
+  std::vector<TRIPLE(Scalar_Type)> operator()(const std::vector<Function_Type>& fs,const std::vector<MULTIARG(Scalar_Type)>& xs,
+					      std::vector<ADTaskTiming>* timings = 0) const
+  {
+    int num_fs = fs.size();
+    int num_threads = std::max(std::min<int>(m_num_threads,num_fs),1);
+    std::vector<TRIPLE(Scalar_Type )> results(num_fs);
+    std::vector<ADTaskTiming> task_timings(timings != 0 ? num_fs : 0);
+    // spin off the threads
+    # pragma omp parallel for num_threads(num_threads) schedule(dynamic,1) if(num_threads > 1)
+    for(int fs_id = 0; fs_id < num_fs; fs_id++)
+      {
+	double start = omp_get_wtime();
+	results[fs_id] = fs[fs_id](xs[fs_id]);
+	if(timings != 0)
+	  {
+	    task_timings[fs_id].thread = omp_get_thread_num();
+	    task_timings[fs_id].seconds = omp_get_wtime() - start;
+	  }
+      }
+    if(timings != 0)
+      {
+	timings->swap(task_timings);
+      }
+    return results;
+  }
+
+  unsigned int num_threads() const { return m_num_threads; }
+
+private:
+  unsigned int m_num_threads;
+};
+
+
+// as adfunc_hessians, with the columns of the hessians (the first order forward directions, each shared by
+// the m second order reverse sweeps) shared out between num_threads threads. Each thread other than the
+// master sweeps its own copy of f_tape and writes its columns of the hessians directly.
+// num_threads = 0 uses omp_get_max_threads() threads.
+template <class T1>
+void adfunc_hessians_parallel(CppAD::ADFun<T1>& f_tape, const std::vector<T1>& eval_point, TENSOR(T1)& hessians,
+			      bool swept = false, MATRIX(T1)* jacobian = 0, unsigned int num_dynamic = 0,
+			      unsigned int num_threads = 0)
+{
+  int xs_AD_vec_size = f_tape.Domain() - num_dynamic;
+  unsigned int a_ys_AD_vec_size = f_tape.Range();
+  if(num_threads == 0)
     {
-      num_threads = num_fs;
+      num_threads = omp_get_max_threads();
     }
-  unsigned int fs_per_thread = num_fs / num_threads;
-  // set the number of threads to use
-  omp_set_num_threads(num_threads);
-  // setup for using CppAD::AD<double> in parallel
+  num_threads = std::max(std::min<int>(num_threads,xs_AD_vec_size),1);
+  adfunc_parallel_setup<T1>(num_threads);
 
-  thread_alloc::parallel_setup(num_threads,in_parallel,thread_number);
-  CppAD::parallel_ad<Scalar_Type>();
+  hessians.resize(1,a_ys_AD_vec_size);
+  for(unsigned int d = 0; d < a_ys_AD_vec_size; d++)
+    {
+      hessians(0,d).resize(xs_AD_vec_size,xs_AD_vec_size);
+    }
+  if(jacobian != 0)
+    {
+      jacobian->resize(a_ys_AD_vec_size,xs_AD_vec_size);
+    }
+
+  // the copies take the zero order Taylor coefficients with them
+  if(!swept)
+    {
+      f_tape.Forward(0,eval_point);
+    }
+  # pragma omp parallel num_threads(num_threads) if(num_threads > 1)
+  {
+    CppAD::ADFun<T1> thread_tape;
+    bool master = omp_get_thread_num() == 0;
+    if(!master)
+      {
+	thread_tape = f_tape;
+      }
+    // the master only sweeps f_tape once every copy has been made
+    # pragma omp barrier
+    CppAD::ADFun<T1>& tape = master ? f_tape : thread_tape;
+    # pragma omp for schedule(dynamic)
+    for(int col = 0; col < xs_AD_vec_size; col++)
+      {
+	adfunc_hessians_col(tape,col,hessians,jacobian,num_dynamic);
+      }
+  }
+}
+
+
+// as adfunc, with the hessians calculated in parallel (see adfunc_hessians_parallel)
+template <class T1,class T2>
+TRIPLE(T1) adfunc_parallel(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,unsigned int order = 2,
+			   ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO,unsigned int num_threads = 0)
+{
+  if(order < 2)
+    {
+      return adfunc(f,xs,ps,order,mode);
+    }
+  MULTIARG(T1) xps = adfunc_append(xs,ps);
+  std::vector<T1> eval_point;
+  adfunc_flatten(xps,eval_point);
+  std::vector<T1> data;
+  adfunc_flatten(ps,data);
+
+  CppAD::ADFun<T1> f_tape;
+  MULTIARG(T2) a_ys;
+  adfunc_record(f,xps,f_tape,a_ys);
+  MATRIX(T1) jacobian;
+  TENSOR(T1) hessians;
+  adfunc_hessians_parallel(f_tape,eval_point,hessians,false,&jacobian,data.size(),num_threads);
+
+  unsigned int num_ys = a_ys.size();
+  MULTIARG(T1) ys(num_ys);
+  for(unsigned int i = 0; i < num_ys; i++)
+    {
+      ys[i] = Convert<MATRIX(T1)>(a_ys[i]);
+    }
+  return boost::make_tuple(ys,jacobian,hessians);
+}
+
+
+// as above, where f has no data
+template <class T1,class T2>
+TRIPLE(T1) adfunc_parallel(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,unsigned int order = 2,
+			   ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO,unsigned int num_threads = 0)
+{
+  return adfunc_parallel(f,xs,MULTIARG(T1)(),order,mode,num_threads);
+}
 
-  std::vector<unsigned int> fs_in_thread(num_threads);
-  for(unsigned int thread_id = 0; thread_id < num_threads; thread_id++)
+
+// sweep f_tape at point p of points (see adfunc_batch), writing the results into the columns of values,
+// jacobians and hessians for p - returns false (without writing the results) if a comparison takes a
+// different branch at p than when f_tape was recorded
+template <class T1>
+bool adfunc_batch_point(CppAD::ADFun<T1>& f_tape,const MATRIX(T1)& points,unsigned int p,
+			MATRIX(T1)& values,MATRIX(T1)& jacobians,MATRIX(T1)& hessians,
+			unsigned int order,ADFUNC_JACOBIAN_MODE mode)
+{
+  unsigned int xs_AD_vec_size = points.rows();
+  unsigned int a_ys_AD_vec_size = values.rows();
+  std::vector<T1> eval_point(xs_AD_vec_size);
+  Eigen::Map<MATRIX(T1)>(eval_point.data(),xs_AD_vec_size,1) = points.col(p);
+  std::vector<T1> y = f_tape.Forward(0,eval_point);
+  if(f_tape.compare_change_number() > 0)
     {
-      fs_in_thread[thread_id] = fs_per_thread;
-    } 
-  for(unsigned int thread_id = 0; thread_id < num_fs%num_threads; thread_id++)
+      return false;
+    }
+  values.col(p) = Eigen::Map<const MATRIX(T1)>(y.data(),a_ys_AD_vec_size,1);
+  if(order == 0)
+    {
+      return true;
+    }
+  MATRIX(T1) jacobian;
+  TENSOR(T1) hessian;
+  adfunc_derivatives(f_tape,eval_point,jacobian,hessian,order,mode,true);
+  jacobians.block(0,p*xs_AD_vec_size,a_ys_AD_vec_size,xs_AD_vec_size) = jacobian;
+  for(unsigned int d = 0; d < hessian.cols(); d++)
     {
-      fs_in_thread[thread_id] += 1; 
+      hessians.block(0,(p*a_ys_AD_vec_size+d)*xs_AD_vec_size,xs_AD_vec_size,xs_AD_vec_size) = hessian(0,d);
     }
-  std::multimap<unsigned int,unsigned int> thread_map;
- 
- {
-    unsigned int fs_id = 0;
-    for(unsigned int thread_id = 0; thread_id < num_threads; thread_id++)
+  return true;
+}
+
+
+// as adfunc_batch, with the points shared out between threads. The tape is recorded once, at the first
+// point, and optimized according to optimize before it is copied to each thread (sweeps change the
+// Taylor coefficients held by a tape, so the threads can not share one). The points are handed out one
+// at a time to whichever thread is free and the results are written into the same columns as by
+// adfunc_batch. Points at which a comparison takes a different branch are done afterwards, each with a
+// tape recorded at that point. num_threads = 0 uses omp_get_max_threads() threads.
+template <class T1,class T2>
+void adfunc_batch_parallel(const FUNCTION(T2)& f,const MULTIARG(T1)& shapes,const MATRIX(T1)& points,
+			   MULTIARG(T1)& ys,MATRIX(T1)& values,MATRIX(T1)& jacobians,MATRIX(T1)& hessians,
+			   unsigned int order = 2,ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO,
+			   const ADOptimize& optimize = ADOptimize(),ADTapeSize* size = 0,unsigned int num_threads = 0)
+{
+  int xs_AD_vec_size = points.rows();
+  int num_points = points.cols();
+  if(num_points == 0)
+    {
+      return;
+    }
+  if(num_threads == 0)
+    {
+      num_threads = omp_get_max_threads();
+    }
+  num_threads = std::min<int>(num_threads,num_points);
+  adfunc_parallel_setup<T1>(num_threads);
+
+  // record the tape at the first point
+  CppAD::ADFun<T1> f_tape;
+  MULTIARG(T2) a_ys;
+  MULTIARG(T1) xs;
+  std::vector<T1> eval_point(xs_AD_vec_size);
+  Eigen::Map<MATRIX(T1)>(eval_point.data(),xs_AD_vec_size,1) = points.col(0);
+  adfunc_unflatten(eval_point,shapes,xs);
+  adfunc_record(f,xs,f_tape,a_ys);
+  ADTapeSize tape_size;
+  adfunc_tape_size(f_tape,tape_size);
+  adfunc_optimize(f_tape,optimize,num_points-1,tape_size);
+  ys.resize(a_ys.size());
+  for(unsigned int i = 0; i < a_ys.size(); i++)
+    {
+      ys[i] = Convert<MATRIX(T1)>(a_ys[i]);
+    }
+  int a_ys_AD_vec_size = f_tape.Range();
+  int num_jacobian_cols = order > 0 ? xs_AD_vec_size*num_points : 0;
+  int num_hessian_cols = order > 1 ? xs_AD_vec_size*a_ys_AD_vec_size*num_points : 0;
+  if(values.rows() != a_ys_AD_vec_size || values.cols() != num_points)
+    {
+      values.resize(a_ys_AD_vec_size,num_points);
+    }
+  if(jacobians.rows() != a_ys_AD_vec_size || jacobians.cols() != num_jacobian_cols)
+    {
+      jacobians.resize(a_ys_AD_vec_size,num_jacobian_cols);
+    }
+  if(hessians.rows() != xs_AD_vec_size || hessians.cols() != num_hessian_cols)
+    {
+      hessians.resize(xs_AD_vec_size,num_hessian_cols);
+    }
+
+  std::vector<char> retape(num_points,0);
+  # pragma omp parallel num_threads(num_threads) if(num_threads > 1)
+  {
+    // the copy is made (and freed) by the thread that uses it, as thread_alloc requires
+    CppAD::ADFun<T1> thread_tape;
+    thread_tape = f_tape;
+    # pragma omp for schedule(dynamic)
+    for(int p = 0; p < num_points; p++)
       {
-	unsigned int num_fs_in_thread = fs_in_thread[thread_id];
-	for(unsigned int count = 0; count < num_fs_in_thread; count++)
-	  {
-	    thread_map.insert(std::make_pair<unsigned int,unsigned int>(thread_id,fs_id));
-	    fs_id++;
-	  } 
-      } 
+	retape[p] = !adfunc_batch_point(thread_tape,points,p,values,jacobians,hessians,order,mode);
+      }
   }
- 
-  std::vector<TRIPLE(Scalar_Type )> results(num_fs);
-  // spin off the threads
-  # pragma omp parallel for
-  for(unsigned int thread_id = 0; thread_id < num_threads; thread_id++)
-    {
-      std::pair<std::multimap<unsigned int,unsigned int>::iterator,std::multimap<unsigned int,unsigned int>::iterator > thread_map_its;
-      thread_map_its = thread_map.equal_range(thread_id);
-      std::multimap<unsigned int,unsigned int>::iterator it = thread_map_its.first;
-      while(it != thread_map_its.second)
+
+  for(int p = 0; p < num_points; p++)
+    {
+      if(retape[p])
 	{
-	  results[it->second] = fs[it->second](xs[it->second]);
-	  it++;
+	  Eigen::Map<MATRIX(T1)>(eval_point.data(),xs_AD_vec_size,1) = points.col(p);
+	  adfunc_unflatten(eval_point,shapes,xs);
+	  adfunc_record(f,xs,f_tape,a_ys);
+	  adfunc_tape_size(f_tape,tape_size);
+	  adfunc_batch_point(f_tape,points,p,values,jacobians,hessians,order,mode);
 	}
     }
+  if(size != 0)
+    {
+      *size = tape_size;
+    }
+}
 
-  return results;
 
+// evaluate the functions fs at xs using a pool (see ADFunPool) of omp_get_max_threads() threads
+// that is created on the first call and kept for later calls
+template <class Scalar_Type>
+std::vector<TRIPLE(Scalar_Type)> 
+adfunc_pool(const std::vector<boost::function<TRIPLE(Scalar_Type) (const MULTIARG(Scalar_Type)&)> >& fs, 
+            const std::vector<MULTIARG(Scalar_Type)>& xs,std::vector<ADTaskTiming>* timings = 0)
+{
+  return CGenericSingleton<ADFunPool<Scalar_Type> >::Instance()(fs,xs,timings);
 }
 
 #endif
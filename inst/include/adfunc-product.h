@@ -0,0 +1,110 @@
+
+
+#ifndef ___ADFUNC_PRODUCT_H___
+#define ___ADFUNC_PRODUCT_H___
+
+#include "cppad.eigen.h"
+#include "adfunc.h"
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+
+// products of the derivatives of f with a vector that do not form the jacobian or hessians.
+// Each costs a small number of sweeps of the tape, independent of the size of the domain.
+//   JV - J v      (one first order forward sweep), v has n entries, the result m entries
+//   VJ - w^T J    (one first order reverse sweep), w has m entries, the result n entries
+//   HV - H_w v    (one first order forward and one second order reverse sweep) where H_w is the
+//                 hessian of sum_k w_k y_k. If w is empty the products H_k v for each output are
+//                 returned as the columns of an n x m matrix (one reverse sweep per output)
+// vectors are flattened column-wise as by adfunc_flatten. As for adfunc_derivatives, the last num_dynamic
+// elements of the domain are data and the products are only with respect to the leading n elements
+enum ADFUNC_PRODUCT {ADFUNC_PRODUCT_JV,ADFUNC_PRODUCT_VJ,ADFUNC_PRODUCT_HV};
+
+
+// the product for the function recorded on f_tape at eval_point
+template <class T1>
+MATRIX(T1) adfunc_product(CppAD::ADFun<T1>& f_tape, const std::vector<T1>& eval_point,
+			  const MATRIX(T1)& v, const MATRIX(T1)& w, ADFUNC_PRODUCT product, unsigned int num_dynamic = 0)
+{
+  unsigned int domain_size = f_tape.Domain();
+  unsigned int xs_AD_vec_size = domain_size - num_dynamic;
+  unsigned int a_ys_AD_vec_size = f_tape.Range();
+
+  // the vectors come from R (see Jv, vJ and Hv) and CppAD does not check them under NDEBUG
+  if(product != ADFUNC_PRODUCT_VJ && v.size() != xs_AD_vec_size)
+    {
+      throw std::invalid_argument("v must have an element for each element of the argument");
+    }
+  if(product == ADFUNC_PRODUCT_VJ ? w.size() != a_ys_AD_vec_size : w.size() != 0 && w.size() != a_ys_AD_vec_size)
+    {
+      throw std::invalid_argument("w must have an element for each element of the result");
+    }
+
+  f_tape.Forward(0,eval_point);
+  MATRIX(T1) result;
+  if(product == ADFUNC_PRODUCT_VJ)
+    {
+      std::vector<T1> vec_w(w.data(),w.data()+w.size());
+      std::vector<T1> dw = f_tape.Reverse(1,vec_w);
+      result = Eigen::Map<const MATRIX(T1)>(dw.data(),xs_AD_vec_size,1);
+      return result;
+    }
+
+  // no change in the direction of the data
+  std::vector<T1> vec_v(domain_size,T1(0.0));
+  std::copy(v.data(),v.data()+v.size(),vec_v.begin());
+  std::vector<T1> dy = f_tape.Forward(1,vec_v);
+  if(product == ADFUNC_PRODUCT_JV)
+    {
+      result = Eigen::Map<const MATRIX(T1)>(dy.data(),a_ys_AD_vec_size,1);
+      return result;
+    }
+
+  if(w.size() > 0)
+    {
+      std::vector<T1> vec_w(w.data(),w.data()+w.size());
+      std::vector<T1> ddw = f_tape.Reverse(2,vec_w);
+      result = Eigen::Map<const Matrix<T1,Dynamic,1>,0,Eigen::InnerStride<2> >(ddw.data()+1,xs_AD_vec_size);
+      return result;
+    }
+  result.resize(xs_AD_vec_size,a_ys_AD_vec_size);
+  std::vector<T1> vec_w(a_ys_AD_vec_size,T1(0.0));
+  for(unsigned int d = 0; d < a_ys_AD_vec_size; d++)
+    {
+      vec_w[d] = T1(1.0);
+      std::vector<T1> ddw = f_tape.Reverse(2,vec_w);
+      vec_w[d] = T1(0.0);
+      result.col(d) = Eigen::Map<const Matrix<T1,Dynamic,1>,0,Eigen::InnerStride<2> >(ddw.data()+1,xs_AD_vec_size);
+    }
+  return result;
+}
+
+
+// the product for f at xs with data ps (records a tape, see adfunc)
+template <class T1,class T2>
+MATRIX(T1) adfunc_product(const FUNCTION(T2)& f, const MULTIARG(T1)& xs, const MULTIARG(T1)& ps,
+			  const MATRIX(T1)& v, const MATRIX(T1)& w, ADFUNC_PRODUCT product)
+{
+  MULTIARG(T1) xps = adfunc_append(xs,ps);
+  std::vector<T1> eval_point;
+  adfunc_flatten(xps,eval_point);
+  std::vector<T1> data;
+  adfunc_flatten(ps,data);
+  CppAD::ADFun<T1> f_tape;
+  MULTIARG(T2) a_ys;
+  adfunc_record(f,xps,f_tape,a_ys);
+  return adfunc_product(f_tape,eval_point,v,w,product,data.size());
+}
+
+
+// the product for f at xs (records a tape)
+template <class T1,class T2>
+MATRIX(T1) adfunc_product(const FUNCTION(T2)& f, const MULTIARG(T1)& xs,
+			  const MATRIX(T1)& v, const MATRIX(T1)& w, ADFUNC_PRODUCT product)
+{
+  return adfunc_product(f,xs,MULTIARG(T1)(),v,w,product);
+}
+
+
+#endif
@@ -0,0 +1,209 @@
+
+
+#ifndef ___ADFUNC_SPARSE_H___
+#define ___ADFUNC_SPARSE_H___
+
+#include "cppad.eigen.h"
+#include "adfunc.h"
+#include <Eigen/Sparse>
+#include <vector>
+#include <algorithm>
+#include <string>
+
+
+#define SPARSEMATRIX(T) Eigen::SparseMatrix<T>
+#define SPARSETENSOR(T) std::vector<SPARSEMATRIX(T) >
+#define SPARSETRIPLE(T) boost::tuple<MULTIARG(T),SPARSEMATRIX(T),SPARSETENSOR(T) >
+
+
+typedef std::vector<size_t> Sparse_Size_Vector_Type;
+typedef CppAD::sparse_rc<Sparse_Size_Vector_Type> Sparse_Pattern_Type;
+
+
+// sparsity patterns and colourings for a tape - these only depend on the tape so can be
+// retained and reused for later sweeps of the same tape at different points
+template <class T1>
+class ADSparseWork
+{
+public:
+  ADSparseWork() : has_jac_pattern(false), has_hes_pattern(false) {}
+
+  bool has_jac_pattern;
+  Sparse_Pattern_Type jac_pattern;
+  CppAD::sparse_jac_work jac_work;
+
+  bool has_hes_pattern;
+  std::vector<Sparse_Pattern_Type> hes_pattern;
+  std::vector<CppAD::sparse_hes_work> hes_work;
+};
+
+
+// convert a CppAD sparse matrix into an Eigen sparse matrix
+template <class T1>
+SPARSEMATRIX(T1) adfunc_sparse_to_eigen(const CppAD::sparse_rcv<Sparse_Size_Vector_Type,std::vector<T1> >& in)
+{
+  typedef Eigen::Triplet<T1> Triplet_Type;
+  std::vector<Triplet_Type> triplets(in.nnz());
+  for(size_t k = 0; k < in.nnz(); k++)
+    {
+      triplets[k] = Triplet_Type(in.row()[k],in.col()[k],in.val()[k]);
+    }
+  SPARSEMATRIX(T1) out(in.nr(),in.nc());
+  out.setFromTriplets(triplets.begin(),triplets.end());
+  return out;
+}
+
+
+// calculate the jacobian of the function recorded on f_tape at eval_point. The sparsity pattern is
+// detected (once per work) using forward jacobian sparsity and the non zero entries calculated using
+// the colouring drivers. mode selects the direction of the sweeps as for adfunc_jacobian. As for
+// adfunc_jacobian the last num_dynamic elements of the domain are data, which are not in the pattern.
+template <class T1>
+void adfunc_sparse_jacobian(CppAD::ADFun<T1>& f_tape, const std::vector<T1>& eval_point, SPARSEMATRIX(T1)& jacobian,
+			    ADSparseWork<T1>& work, ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO, size_t num_dynamic = 0)
+{
+  size_t domain_size = f_tape.Domain();
+  size_t xs_AD_vec_size = domain_size - num_dynamic;
+  size_t a_ys_AD_vec_size = f_tape.Range();
+
+  if(!work.has_jac_pattern)
+    {
+      // the pattern for the leading columns, widened to the whole domain as required by the drivers
+      Sparse_Pattern_Type identity(domain_size,xs_AD_vec_size,xs_AD_vec_size);
+      for(size_t k = 0; k < xs_AD_vec_size; k++)
+	{
+	  identity.set(k,k,k);
+	}
+      Sparse_Pattern_Type pattern;
+      f_tape.for_jac_sparsity(identity,false,false,false,pattern);
+      work.jac_pattern.resize(a_ys_AD_vec_size,domain_size,pattern.nnz());
+      for(size_t k = 0; k < pattern.nnz(); k++)
+	{
+	  work.jac_pattern.set(k,pattern.row()[k],pattern.col()[k]);
+	}
+      work.has_jac_pattern = true;
+    }
+
+  if(mode == ADFUNC_JACOBIAN_AUTO)
+    {
+      mode = a_ys_AD_vec_size <= xs_AD_vec_size ? ADFUNC_JACOBIAN_REVERSE : ADFUNC_JACOBIAN_FORWARD;
+    }
+
+  CppAD::sparse_rcv<Sparse_Size_Vector_Type,std::vector<T1> > subset(work.jac_pattern);
+  if(mode == ADFUNC_JACOBIAN_FORWARD)
+    {
+      f_tape.sparse_jac_for(xs_AD_vec_size,eval_point,subset,work.jac_pattern,"cppad",work.jac_work);
+    }
+  else
+    {
+      f_tape.sparse_jac_rev(eval_point,subset,work.jac_pattern,"cppad",work.jac_work);
+    }
+  jacobian = adfunc_sparse_to_eigen(subset).leftCols(xs_AD_vec_size);
+}
+
+
+// calculate the hessians of every component of the function recorded on f_tape at eval_point.
+// The sparsity pattern of each hessian is detected (once per work) using forward hessian sparsity.
+// The last num_dynamic elements of the domain are data, as for adfunc_sparse_jacobian.
+template <class T1>
+void adfunc_sparse_hessians(CppAD::ADFun<T1>& f_tape, const std::vector<T1>& eval_point, SPARSETENSOR(T1)& hessians,
+			    ADSparseWork<T1>& work, size_t num_dynamic = 0)
+{
+  size_t domain_size = f_tape.Domain();
+  size_t xs_AD_vec_size = domain_size - num_dynamic;
+  size_t a_ys_AD_vec_size = f_tape.Range();
+
+  if(!work.has_hes_pattern)
+    {
+      work.hes_pattern.resize(a_ys_AD_vec_size);
+      work.hes_work.resize(a_ys_AD_vec_size);
+      std::vector<bool> select_domain(domain_size,false);
+      std::fill(select_domain.begin(),select_domain.begin()+xs_AD_vec_size,true);
+      std::vector<bool> select_range(a_ys_AD_vec_size,false);
+      for(size_t d = 0; d < a_ys_AD_vec_size; d++)
+	{
+	  select_range[d] = true;
+	  f_tape.for_hes_sparsity(select_domain,select_range,false,work.hes_pattern[d]);
+	  select_range[d] = false;
+	}
+      work.has_hes_pattern = true;
+    }
+
+  hessians.resize(a_ys_AD_vec_size);
+  std::vector<T1> w(a_ys_AD_vec_size,T1(0.0));
+  for(size_t d = 0; d < a_ys_AD_vec_size; d++)
+    {
+      CppAD::sparse_rcv<Sparse_Size_Vector_Type,std::vector<T1> > subset(work.hes_pattern[d]);
+      w[d] = T1(1.0);
+      f_tape.sparse_hes(eval_point,w,subset,work.hes_pattern[d],"cppad.symmetric",work.hes_work[d]);
+      w[d] = T1(0.0);
+      hessians[d] = adfunc_sparse_to_eigen(subset).topLeftCorner(xs_AD_vec_size,xs_AD_vec_size);
+    }
+}
+
+
+// calculate the sparse jacobian (order >= 1) and hessians (order >= 2) of the function recorded on
+// f_tape at eval_point. Derivatives that are not asked for are left empty.
+template <class T1>
+void adfunc_sparse_derivatives(CppAD::ADFun<T1>& f_tape, const std::vector<T1>& eval_point,
+			       SPARSEMATRIX(T1)& jacobian, SPARSETENSOR(T1)& hessians, ADSparseWork<T1>& work,
+			       unsigned int order = 2, ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO, size_t num_dynamic = 0)
+{
+  jacobian.resize(0,0);
+  hessians.clear();
+  if(order == 0)
+    {
+      return;
+    }
+  adfunc_sparse_jacobian(f_tape,eval_point,jacobian,work,mode,num_dynamic);
+  if(order < 2)
+    {
+      return;
+    }
+  adfunc_sparse_hessians(f_tape,eval_point,hessians,work,num_dynamic);
+}
+
+
+// as adfunc, but the jacobian and hessians are returned as sparse matrices
+template <class T1,class T2>
+SPARSETRIPLE(T1) adfunc_sparse
+(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,unsigned int order = 2,ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO)
+{
+  typedef MULTIARG(T1) MultiArg_Type_1;
+  typedef SPARSEMATRIX(T1) Sparse_Matrix_Type_1;
+  typedef SPARSETENSOR(T1) Sparse_Tensor_Type_1;
+
+  Sparse_Matrix_Type_1 jacobian;
+  Sparse_Tensor_Type_1 hessians;
+  if(order == 0)
+    {
+      MultiArg_Type_1 ys;
+      adfunc_evaluate(f,xs,ys);
+      return boost::make_tuple(ys,jacobian,hessians);
+    }
+
+  // create a vector representing the point at which the jacobian and hessian will be calculated
+  std::vector<T1> eval_point;
+  adfunc_flatten(xs,eval_point);
+
+  // record the tape
+  CppAD::ADFun<T1> f_tape;
+  MULTIARG(T2) a_ys;
+  adfunc_record(f,xs,f_tape,a_ys);
+
+  // calculate the derivatives
+  ADSparseWork<T1> work;
+  adfunc_sparse_derivatives(f_tape,eval_point,jacobian,hessians,work,order,mode);
+
+  // result matrices
+  unsigned int num_ys = a_ys.size();
+  MultiArg_Type_1  ys(num_ys);
+  for(unsigned int i = 0; i < num_ys; i++)
+    {
+      ys[i] = Convert<MATRIX(T1)>(a_ys[i]);
+    }
+  return boost::make_tuple(ys,jacobian,hessians);
+}
+
+
+#endif
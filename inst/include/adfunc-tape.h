@@ -0,0 +1,194 @@
+
+
+#ifndef ___ADFUNC_TAPE_H___
+#define ___ADFUNC_TAPE_H___
+
+#include "cppad.eigen.h"
+#include "adfunc.h"
+#include "adfunc-cache.h"
+#include "adfunc-sparse.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+
+
+// a tape recorded for f at xs with data ps that is kept (eg by R through an external pointer) and swept
+// on request. eval_point is the point of the last zero order sweep - its first n elements are the
+// flattened xs and the remaining num_dynamic elements the flattened data. The sparsity patterns are
+// retained in work for later sparse jacobians.
+template <class T1>
+class ADRecording : public ADTape<T1>
+{
+public:
+  std::vector<T1> eval_point;
+  ADSparseWork<T1> work;
+
+  unsigned int xs_size() const { return eval_point.size() - this->num_dynamic; }
+};
+
+
+// throw if a vector passed to a sweep of a tape (eg from R) does not have the size the tape requires
+inline void adfunc_tape_check_size(size_t size,size_t required,const char* what)
+{
+  if(size != required)
+    {
+      std::ostringstream message;
+      message << what << " has " << size << " elements but the tape requires " << required;
+      throw std::invalid_argument(message.str());
+    }
+}
+
+
+// throw if a sweep of order q > 1 follows one in several directions (eg the forward mode of adfunc_tape_jacobian).
+// CppAD only checks this when NDEBUG is not defined and otherwise returns partials of 0
+template <class T1>
+void adfunc_tape_check_direction(const ADRecording<T1>& t,unsigned int q)
+{
+  if(q > 1 && t.f_tape.size_direction() != 1)
+    {
+      throw std::invalid_argument("a sweep of order q > 1 requires the coefficients of a single direction on the tape, "
+				  "sweep forward from order 0 first");
+    }
+}
+
+
+// record f at xs with data ps (see adfunc) onto t, leaving the zero order coefficients at xs on the tape
+template <class T1,class T2>
+void adfunc_tape_record(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,ADRecording<T1>& t)
+{
+  MULTIARG(T1) xps = adfunc_append(xs,ps);
+  MULTIARG(T2) a_ys;
+  adfunc_record(f,xps,t.f_tape,a_ys);
+  adfunc_tape_size(t.f_tape,t.size);
+  unsigned int num_ys = a_ys.size();
+  t.ys.resize(num_ys);
+  for(unsigned int i = 0; i < num_ys; i++)
+    {
+      t.ys[i] = Convert<MATRIX(T1)>(a_ys[i]);
+    }
+  adfunc_flatten(xps,t.eval_point);
+  std::vector<T1> data;
+  adfunc_flatten(ps,data);
+  t.num_dynamic = data.size();
+  t.reuses = 0;
+  t.work = ADSparseWork<T1>();
+  t.f_tape.Forward(0,t.eval_point);
+}
+
+
+// move the point of t to x (the flattened xs), keeping the data
+template <class T1>
+void adfunc_tape_point(ADRecording<T1>& t,const std::vector<T1>& x)
+{
+  adfunc_tape_check_size(x.size(),t.xs_size(),"the point");
+  std::copy(x.begin(),x.end(),t.eval_point.begin());
+}
+
+
+// replace the data of t by ps (which must have the shapes of the data it was recorded with)
+template <class T1>
+void adfunc_tape_data(ADRecording<T1>& t,const MULTIARG(T1)& ps)
+{
+  std::vector<T1> data;
+  adfunc_flatten(ps,data);
+  adfunc_tape_check_size(data.size(),t.num_dynamic,"the data");
+  std::copy(data.begin(),data.end(),t.eval_point.begin()+t.xs_size());
+  t.f_tape.Forward(0,t.eval_point);
+}
+
+
+// forward sweep of order q - xq are the coefficients of order q of the flattened xs (those of the data are
+// their values for q = 0 and 0 otherwise) and the coefficients of order q of the range are returned.
+// As with ADFun::Forward the coefficients of lower orders must already be on the tape.
+template <class T1>
+std::vector<T1> adfunc_tape_forward(ADRecording<T1>& t,unsigned int q,const std::vector<T1>& xq)
+{
+  if(q > t.f_tape.size_order())
+    {
+      throw std::invalid_argument("a forward sweep requires the coefficients of all lower orders to be on the tape");
+    }
+  adfunc_tape_check_direction(t,q);
+  t.reuses++;
+  if(q == 0)
+    {
+      adfunc_tape_point(t,xq);
+      return t.f_tape.Forward(0,t.eval_point);
+    }
+  adfunc_tape_check_size(xq.size(),t.xs_size(),"the coefficients");
+  std::vector<T1> u(t.eval_point.size(),T1(0.0));
+  std::copy(xq.begin(),xq.end(),u.begin());
+  return t.f_tape.Forward(q,u);
+}
+
+
+// reverse sweep of order q with weights w for the range (m*q of them, as for ADFun::Reverse) - the partials with respect to
+// the flattened xs are returned (q per element) and those with respect to the data are dropped
+template <class T1>
+std::vector<T1> adfunc_tape_reverse(ADRecording<T1>& t,unsigned int q,const std::vector<T1>& w)
+{
+  if(q < 1 || q > t.f_tape.size_order())
+    {
+      throw std::invalid_argument("a reverse sweep of order q requires q orders of coefficients on the tape");
+    }
+  adfunc_tape_check_direction(t,q);
+  adfunc_tape_check_size(w.size(),t.f_tape.Range()*q,"the weights");
+  std::vector<T1> dw = t.f_tape.Reverse(q,w);
+  dw.resize(t.xs_size()*q);
+  return dw;
+}
+
+
+// the jacobian of the tape at x
+template <class T1>
+MATRIX(T1) adfunc_tape_jacobian(ADRecording<T1>& t,const std::vector<T1>& x,ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO)
+{
+  t.reuses++;
+  adfunc_tape_point(t,x);
+  MATRIX(T1) jacobian;
+  adfunc_jacobian(t.f_tape,t.eval_point,jacobian,mode,false,t.num_dynamic);
+  return jacobian;
+}
+
+
+// the hessians of every component of the tape at x
+template <class T1>
+TENSOR(T1) adfunc_tape_hessians(ADRecording<T1>& t,const std::vector<T1>& x)
+{
+  t.reuses++;
+  adfunc_tape_point(t,x);
+  TENSOR(T1) hessians;
+  adfunc_hessians(t.f_tape,t.eval_point,hessians,false,(MATRIX(T1)*) 0,t.num_dynamic);
+  return hessians;
+}
+
+
+// the sparse jacobian of the tape at x, the sparsity pattern is detected on the first call
+template <class T1>
+SPARSEMATRIX(T1) adfunc_tape_sparse_jacobian(ADRecording<T1>& t,const std::vector<T1>& x,
+					     ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO)
+{
+  t.reuses++;
+  adfunc_tape_point(t,x);
+  SPARSEMATRIX(T1) jacobian;
+  adfunc_sparse_jacobian(t.f_tape,t.eval_point,jacobian,t.work,mode,t.num_dynamic);
+  return jacobian;
+}
+
+
+// optimize the tape (once) with the given options - returns true if the tape was optimized
+template <class T1>
+bool adfunc_tape_optimize(ADRecording<T1>& t,const std::string& options = "")
+{
+  if(!adfunc_optimize(t.f_tape,ADOptimize(ADFUNC_OPTIMIZE_ALWAYS,0,options),t.reuses,t.size))
+    {
+      return false;
+    }
+  // optimizing discards the Taylor coefficients
+  t.f_tape.Forward(0,t.eval_point);
+  return true;
+}
+
+
+#endif
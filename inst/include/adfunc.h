@@ -6,144 +6,371 @@
 #include "cppad.eigen.h"
 #include <boost/function.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <string>
 
 
 
+// the flattening order used throughout - each matrix in a MULTIARG is stored column by column (the
+// storage order of both Eigen and R) and the matrices are stored one after the other. So the k-th
+// element of the flattened vector for a single n x m matrix X is X(k % n,k / n), matching as.vector(X)
+// in R. Rows of the jacobian and hessians, and their columns, are numbered in this order.
+
+
+// flatten the matrices in xs into a single vector (column by column within each matrix)
 template <class T1,class T2>
-TRIPLE(T1) adfunc
-(const FUNCTION(T2)& f,const MULTIARG(T1)& xs)
+void adfunc_flatten(const MULTIARG(T1)& xs, std::vector<T2>& v)
 {
-  typedef MULTIARG(T1) MultiArg_Type_1;
-  typedef MATRIX(T1) Matrix_Type_1; 
-  typedef MATRIX(T2) Matrix_Type_2; 
-  typedef TENSOR(T1) Tensor_Type_1;
-  typedef TRIPLE(T1) Triple_Type_1;
-
   unsigned int num_xs = xs.size();
-  typename MultiArg_Type_1::const_iterator it_xs = xs.begin();
-  typename MultiArg_Type_1::const_iterator it_xs_end = xs.end();
-
-  // determine size of AD vector for use with ADfun and INdependent
-  unsigned int xs_AD_vec_size = 0;
-  while(it_xs != it_xs_end)
+  // determine size of the vector
+  unsigned int vec_size = 0;
+  for(unsigned int i = 0; i < num_xs; i++)
     {
-      xs_AD_vec_size += (*it_xs).rows()*(*it_xs).cols() ;
-      it_xs++;
+      vec_size += xs[i].size();
     }
-  // create an AD vector for use with ADfun and Independent
-  std::vector<T2> a_vec_x(xs_AD_vec_size);
-  // create a vector representing the point at which the jacobian and hessian will be calculated
-  std::vector<T1> eval_point(xs_AD_vec_size);
-  // populate the vectors
-  it_xs = xs.begin();
+  v.resize(vec_size);
+  // populate the vector - a contiguous copy of each matrix
   unsigned int cursor = 0;
-  while(it_xs != it_xs_end)
+  for(unsigned int i = 0; i < num_xs; i++)
     {
-      unsigned int x_nrows = (*it_xs).rows();
-      unsigned int x_ncols = (*it_xs).cols();
-      for(int row = 0; row < x_nrows; row++)
-	{
-	  for(int col = 0; col < x_ncols; col++)
-	    { 
-	      a_vec_x[cursor] = eval_point[cursor] = (*it_xs)(row,col);
-	      cursor++;
-	    }
-	}
-      it_xs++;
+      Eigen::Map<MATRIX(T2)>(v.data()+cursor,xs[i].rows(),xs[i].cols()) = xs[i].template cast<T2>();
+      cursor += xs[i].size();
     }
- 
+}
+
+// the inverse of adfunc_flatten - wrap the vector v into matrices having the same shapes as those in shapes
+template <class T1,class T2>
+void adfunc_unflatten(const std::vector<T1>& v, const MULTIARG(T2)& shapes, MULTIARG(T1)& xs)
+{
+  unsigned int num_xs = shapes.size();
+  xs.resize(num_xs);
+  unsigned int cursor = 0;
+  for(unsigned int i = 0; i < num_xs; i++)
+    {
+      xs[i] = Eigen::Map<const MATRIX(T1)>(v.data()+cursor,shapes[i].rows(),shapes[i].cols());
+      cursor += shapes[i].size();
+    }
+}
+
+// record f at the point xs onto f_tape - the (AD) values of f are returned in a_ys 
+template <class T1,class T2>
+void adfunc_record(const FUNCTION(T2)& f,const MULTIARG(T1)& xs, CppAD::ADFun<T1>& f_tape, MULTIARG(T2)& a_ys)
+{
+  // create an AD vector for use with ADfun and Independent
+  std::vector<T2> a_vec_x;
+  adfunc_flatten(xs,a_vec_x);
   // start the tape recording
   CppAD::Independent(a_vec_x);  
   // wrap the vector into an aMat for dispatching to f
-  std::vector<Matrix_Type_2 > a_xs(num_xs);
-  it_xs = xs.begin();
-  cursor = 0;
-  unsigned int xs_entry = 0;
-  while(it_xs != it_xs_end)
+  MULTIARG(T2) a_xs;
+  adfunc_unflatten(a_vec_x,xs,a_xs);
+  // dispatch to f
+  a_ys = f(a_xs);
+  // unwrap the result into a vector for the tape
+  std::vector<T2> a_vec_y;
+  adfunc_flatten(a_ys,a_vec_y);
+  // process the tape
+  f_tape.Dependent(a_vec_x, a_vec_y);
+}
+
+// when a tape that is swept repeatedly is passed to ADFun::optimize - never, as soon as it is recorded, or
+// once it has been reused a given number of times. options are passed on to optimize, eg "no_conditional_skip"
+// or "no_compare_op" (NB with no_compare_op a change of branch can no longer be detected, so a tape is not
+// recorded again when the point moves to a different branch)
+enum ADFUNC_OPTIMIZE_POLICY {ADFUNC_OPTIMIZE_NEVER,ADFUNC_OPTIMIZE_ALWAYS,ADFUNC_OPTIMIZE_AFTER};
+
+class ADOptimize
+{
+public:
+  ADOptimize(ADFUNC_OPTIMIZE_POLICY policy_ = ADFUNC_OPTIMIZE_NEVER,unsigned int reuses_ = 0,const std::string& options_ = "")
+    : policy(policy_), reuses(reuses_), options(options_) {}
+
+  ADFUNC_OPTIMIZE_POLICY policy;
+  unsigned int reuses;
+  std::string options;
+};
+
+
+// the size of a tape when it was recorded and its current size (which differs once it is optimized)
+class ADTapeSize
+{
+public:
+  ADTapeSize() : size_var_recorded(0), size_op_recorded(0), size_var(0), size_op(0), optimized(false) {}
+
+  size_t size_var_recorded;
+  size_t size_op_recorded;
+  size_t size_var;
+  size_t size_op;
+  bool optimized;
+};
+
+
+// note the size of a newly recorded tape
+template <class T1>
+void adfunc_tape_size(const CppAD::ADFun<T1>& f_tape, ADTapeSize& size)
+{
+  size.size_var_recorded = size.size_var = f_tape.size_var();
+  size.size_op_recorded = size.size_op = f_tape.size_op();
+  size.optimized = false;
+}
+
+
+// optimize f_tape if the policy requires it now that it has been reused reuses times - returns true if
+// the tape was optimized. NB - optimizing discards the Taylor coefficients of previous sweeps
+template <class T1>
+bool adfunc_optimize(CppAD::ADFun<T1>& f_tape, const ADOptimize& optimize, unsigned int reuses, ADTapeSize& size)
+{
+  if(size.optimized || optimize.policy == ADFUNC_OPTIMIZE_NEVER)
+    {
+      return false;
+    }
+  if(optimize.policy == ADFUNC_OPTIMIZE_AFTER && reuses < optimize.reuses)
+    {
+      return false;
+    }
+  f_tape.optimize(optimize.options);
+  size.size_var = f_tape.size_var();
+  size.size_op = f_tape.size_op();
+  size.optimized = true;
+  return true;
+}
+
+
+// NB - in what follows swept indicates that the zero order Taylor coefficients of f_tape are already those
+// at eval_point (eg from a Forward(0,eval_point) used to obtain the value of the function), in which case
+// the zero order forward sweep is not repeated. The last num_dynamic elements of the domain of f_tape are
+// data rather than arguments (see adfunc with ps below) - derivatives are only taken with respect to the
+// leading elements, so n is the size of the domain less num_dynamic.
+
+
+// the col-th column of each of the (already sized) hessians of the function recorded on f_tape, whose
+// zero order Taylor coefficients must be those at the point. If jacobian is given and col is 0 the
+// jacobian is filled too (see adfunc_hessians). If weights are given the dth hessian (and row of the
+// jacobian) is that of the sum of the outputs weighted by the dth row of weights rather than of output d
+template <class T1>
+void adfunc_hessians_col(CppAD::ADFun<T1>& f_tape, unsigned int col, TENSOR(T1)& hessians,
+			 MATRIX(T1)* jacobian = 0, unsigned int num_dynamic = 0, const MATRIX(T1)* weights = 0)
+{
+  unsigned int domain_size = f_tape.Domain();
+  unsigned int xs_AD_vec_size = domain_size - num_dynamic;
+  unsigned int a_ys_AD_vec_size = f_tape.Range();
+  unsigned int num_weightings = weights != 0 ? weights->rows() : a_ys_AD_vec_size;
+
+  // first order sweep in the direction of the col-th coordinate
+  std::vector<T1> u(domain_size,T1(0.0));
+  u[col] = T1(1.0);
+  f_tape.Forward(1,u);
+  // reverse sweep for each output weighting
+  std::vector<T1> w(a_ys_AD_vec_size,T1(0.0));
+  for(unsigned int d = 0; d < num_weightings; d++)
     {
-      unsigned int x_nrows = (*it_xs).rows();
-      unsigned int x_ncols = (*it_xs).cols();
-      Matrix_Type_2 a_mat_x(x_nrows,x_ncols);
-      for(int row = 0; row < x_nrows; row++)
+      if(weights != 0)
 	{
-	  for(int col = 0; col < x_ncols; col++)
-	    { 
-	      a_mat_x(row,col) = a_vec_x[cursor++];
-	    }
+	  Eigen::Map<Matrix<T1,1,Dynamic> >(w.data(),a_ys_AD_vec_size) = weights->row(d);
+	}
+      else
+	{
+	  w[d] = T1(1.0);
+	}
+      std::vector<T1> ddw = f_tape.Reverse(2,w);
+      if(weights == 0)
+	{
+	  w[d] = T1(0.0);
+	}
+      // the second order partials are every other entry of ddw, the first order partials are in between
+      hessians(0,d).col(col) = Eigen::Map<const Matrix<T1,Dynamic,1>,0,Eigen::InnerStride<2> >(ddw.data()+1,xs_AD_vec_size);
+      if(jacobian != 0 && col == 0)
+	{
+	  jacobian->row(d) = Eigen::Map<const Matrix<T1,1,Dynamic>,0,Eigen::InnerStride<2> >(ddw.data(),xs_AD_vec_size);
 	}
-      a_xs[xs_entry++] = a_mat_x;
-      *it_xs++;
     }
-  
-  // dispatch to f
-  std::vector<Matrix_Type_2 > a_ys = f(a_xs);
+}
+
+
+// calculate the hessians of every component of the function recorded on f_tape at eval_point.
+// Each of the n first order forward directions is swept once and shared by the m second order
+// reverse sweeps (one per output weighting), rather than calling f_tape.Hessian(eval_point,d) for
+// each output which repeats the zero and first order forward sweeps m times. The second order
+// reverse sweeps also give the first order partials of the weighted output, so if jacobian is
+// given the jacobian is filled from the sweeps for the first direction at no extra cost.
+// Only the forward sweeps are shared, there are still n*m second order reverse sweeps as this
+// version of CppAD has no reverse sweep for several weightings or directions at order 2 (Reverse
+// takes a single weighting and only accepts several forward directions for order 1).
+template <class T1>
+void adfunc_hessians(CppAD::ADFun<T1>& f_tape, const std::vector<T1>& eval_point, TENSOR(T1)& hessians,
+		     bool swept = false, MATRIX(T1)* jacobian = 0, unsigned int num_dynamic = 0)
+{
+  unsigned int domain_size = f_tape.Domain();
+  unsigned int xs_AD_vec_size = domain_size - num_dynamic;
+  unsigned int a_ys_AD_vec_size = f_tape.Range();
 
-  // unwrap the result into a vector for the tape and a matrix for the result
-  unsigned int num_a_ys = a_ys.size();
-  typename std::vector<Matrix_Type_2 >::const_iterator it_a_ys = a_ys.begin();
-  typename std::vector<Matrix_Type_2 >::const_iterator it_a_ys_end = a_ys.end();
-  // determine size of AD vector for use with ADfun and INdependent
-  unsigned int a_ys_AD_vec_size = 0;
-  while(it_a_ys != it_a_ys_end)
+  hessians.resize(1,a_ys_AD_vec_size);
+  for(unsigned int d = 0; d < a_ys_AD_vec_size; d++)
     {
-      a_ys_AD_vec_size += (*it_a_ys).rows()*(*it_a_ys).cols() ;
-      it_a_ys++;
+      hessians(0,d).resize(xs_AD_vec_size,xs_AD_vec_size);
+    }
+  if(jacobian != 0)
+    {
+      jacobian->resize(a_ys_AD_vec_size,xs_AD_vec_size);
     }
-  // create an AD vector for use with ADfun and Independent
-  std::vector<T2> a_vec_y(a_ys_AD_vec_size);
 
- 
-  it_a_ys = a_ys.begin();
-  cursor = 0;
-  while(it_a_ys != it_a_ys_end)
+  if(!swept)
     {
-      unsigned int y_nrows = (*it_a_ys).rows();
-      unsigned int y_ncols = (*it_a_ys).cols();
-      for(int row = 0; row < y_nrows; row++)
-	{
-	  for(int col = 0; col < y_ncols; col++)
-	    { 
-	      a_vec_y[cursor++] = (*it_a_ys)(row,col);
-	    }
-	}
-      it_a_ys++;
+      f_tape.Forward(0,eval_point);
     }
+  for(unsigned int col = 0; col < xs_AD_vec_size; col++)
+    {
+      adfunc_hessians_col(f_tape,col,hessians,jacobian,num_dynamic);
+    }
+}
 
-  // process the tape
-  // CppAD::ADFun<T1> f_tape(a_vec_x, a_vec_y);
-  CppAD::ADFun<T1> f_tape; 
-  f_tape.Dependent(a_vec_x, a_vec_y);
+// how the jacobian is calculated - AUTO uses reverse mode when there are no more outputs than inputs
+// (a single reverse sweep gives the gradient of a scalar function) and forward mode otherwise
+enum ADFUNC_JACOBIAN_MODE {ADFUNC_JACOBIAN_AUTO,ADFUNC_JACOBIAN_FORWARD,ADFUNC_JACOBIAN_REVERSE};
 
-  // calculate the Jacobian
-  std::vector<T1> v_jacobian = f_tape.Jacobian(eval_point);  // TODO -will need to do this across additional directions later
 
-  // unwrap into the jacobian
-  Matrix_Type_1 jacobian(a_ys_AD_vec_size,xs_AD_vec_size);
-  cursor = 0;
-  for(int row = 0; row < a_ys_AD_vec_size; row++)
+// calculate the jacobian of the function recorded on f_tape at eval_point
+template <class T1>
+void adfunc_jacobian(CppAD::ADFun<T1>& f_tape, const std::vector<T1>& eval_point, MATRIX(T1)& jacobian,
+		     ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO, bool swept = false, unsigned int num_dynamic = 0)
+{
+  unsigned int domain_size = f_tape.Domain();
+  unsigned int xs_AD_vec_size = domain_size - num_dynamic;
+  unsigned int a_ys_AD_vec_size = f_tape.Range();
+
+  if(mode == ADFUNC_JACOBIAN_AUTO)
     {
-      for(int col = 0; col < xs_AD_vec_size; col++)
-        { 
-	  jacobian(row,col) = v_jacobian[cursor++];
-    
-        }
+      mode = a_ys_AD_vec_size <= xs_AD_vec_size ? ADFUNC_JACOBIAN_REVERSE : ADFUNC_JACOBIAN_FORWARD;
     }
-  
-  Tensor_Type_1 hessians(1,a_ys_AD_vec_size);
-  for(int d = 0; d < a_ys_AD_vec_size; d++)
+
+  jacobian.resize(a_ys_AD_vec_size,xs_AD_vec_size);
+  if(!swept)
+    {
+      f_tape.Forward(0,eval_point);
+    }
+  if(mode == ADFUNC_JACOBIAN_FORWARD)
+    {
+      // a single first order sweep along all n coordinate directions
+      std::vector<T1> u(domain_size*xs_AD_vec_size,T1(0.0));
+      for(unsigned int col = 0; col < xs_AD_vec_size; col++)
+	{
+	  u[col*xs_AD_vec_size+col] = T1(1.0);
+	}
+      std::vector<T1> dy = f_tape.Forward(1,xs_AD_vec_size,u);
+      // dy holds the directions for each output contiguously
+      jacobian = Eigen::Map<const Matrix<T1,Dynamic,Dynamic,Eigen::RowMajor> >(dy.data(),a_ys_AD_vec_size,xs_AD_vec_size);
+    }
+  else
     {
-      std::vector<T1> v_hessian = f_tape.Hessian(eval_point,d);  
-      Matrix_Type_1 hessian(xs_AD_vec_size,xs_AD_vec_size);
-      cursor = 0;
-      for(int row = 0; row < xs_AD_vec_size; row++)
+      // a first order reverse sweep for each output
+      std::vector<T1> w(a_ys_AD_vec_size,T1(0.0));
+      for(unsigned int row = 0; row < a_ys_AD_vec_size; row++)
 	{
-	  for(int col = 0; col < xs_AD_vec_size; col++)
-	    {
-	      hessian(row,col) = v_hessian[cursor++]; 
-	    } 
-	  hessians(0,d) = hessian;
+	  w[row] = T1(1.0);
+	  std::vector<T1> dw = f_tape.Reverse(1,w);
+	  w[row] = T1(0.0);
+	  jacobian.row(row) = Eigen::Map<const Matrix<T1,1,Dynamic> >(dw.data(),xs_AD_vec_size);
 	}
     }
+}
+
+
+// calculate the jacobian (order >= 1) and hessians (order >= 2) of the function recorded on f_tape at
+// eval_point. Derivatives that are not asked for are left empty. The zero order forward sweep is made
+// at most once (not at all if swept), and when the hessians are required the jacobian is obtained
+// from the same sweeps (so mode only applies when order is 1)
+template <class T1>
+void adfunc_derivatives(CppAD::ADFun<T1>& f_tape, const std::vector<T1>& eval_point, MATRIX(T1)& jacobian, TENSOR(T1)& hessians, 
+			unsigned int order = 2, ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO, bool swept = false,
+			unsigned int num_dynamic = 0)
+{
+  // NB - jacobian and hessians are only resized when their shape changes, so they can be reused across calls
+  if(order == 0)
+    {
+      jacobian.resize(0,0);
+      hessians.resize(0,0);
+      return;
+    }
+
+  if(order < 2)
+    {
+      adfunc_jacobian(f_tape,eval_point,jacobian,mode,swept,num_dynamic);
+      hessians.resize(0,0);
+      return;
+    }
+  adfunc_hessians(f_tape,eval_point,hessians,swept,&jacobian,num_dynamic);
+}
+
+
+// evaluate f at xs without recording a tape - the values are returned in ys
+template <class T1,class T2>
+void adfunc_evaluate(const FUNCTION(T2)& f,const MULTIARG(T1)& xs, MULTIARG(T1)& ys)
+{
+  unsigned int num_xs = xs.size();
+  MULTIARG(T2) a_xs(num_xs);
+  for(unsigned int i = 0; i < num_xs; i++)
+    {
+      a_xs[i] = Convert<MATRIX(T2)>(xs[i]);
+    }
+  MULTIARG(T2) a_ys = f(a_xs);
+  unsigned int num_ys = a_ys.size();
+  ys.resize(num_ys);
+  for(unsigned int i = 0; i < num_ys; i++)
+    {
+      ys[i] = Convert<MATRIX(T1)>(a_ys[i]);
+    }
+}
+
+
+// append the data ps to the arguments xs (see adfunc with ps below)
+template <class T1>
+MULTIARG(T1) adfunc_append(const MULTIARG(T1)& xs,const MULTIARG(T1)& ps)
+{
+  MULTIARG(T1) xps(xs);
+  xps.insert(xps.end(),ps.begin(),ps.end());
+  return xps;
+}
+
+
+// the value of f at xs along with its jacobian (order >= 1) and hessians (order >= 2). 
+// Derivatives that are not asked for are left empty, and order 0 does not record a tape.
+// mode selects how the jacobian is calculated.
+// ps are data - f is called with the matrices in xs followed by those in ps and the derivatives are only
+// taken with respect to xs. The data are recorded as independent variables of the tape rather than as
+// constants (the vendored CppAD has no dynamic parameters), so a tape recorded for one set of data gives
+// the derivatives for any other set of data of the same shape by sweeping it at the new point.
+template <class T1,class T2>
+TRIPLE(T1) adfunc
+(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,const MULTIARG(T1)& ps,unsigned int order = 2,
+ ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO)
+{
+  typedef MULTIARG(T1) MultiArg_Type_1;
+  typedef MATRIX(T1) Matrix_Type_1; 
+  typedef TENSOR(T1) Tensor_Type_1;
+  typedef TRIPLE(T1) Triple_Type_1;
+
+  MultiArg_Type_1 xps = adfunc_append(xs,ps);
+  Matrix_Type_1 jacobian;
+  Tensor_Type_1 hessians;
+  if(order == 0)
+    {
+      MultiArg_Type_1 ys;
+      adfunc_evaluate(f,xps,ys);
+      return boost::make_tuple(ys,jacobian,hessians);
+    }
+
+  // create a vector representing the point at which the jacobian and hessian will be calculated
+  std::vector<T1> eval_point;
+  adfunc_flatten(xps,eval_point);
+  std::vector<T1> data;
+  adfunc_flatten(ps,data);
+
+  // record the tape
+  CppAD::ADFun<T1> f_tape; 
+  MULTIARG(T2) a_ys;
+  adfunc_record(f,xps,f_tape,a_ys);
+
+  // calculate the derivatives
+  adfunc_derivatives(f_tape,eval_point,jacobian,hessians,order,mode,false,data.size());
   
   // result matrices
   unsigned int num_ys = a_ys.size();
@@ -158,6 +385,15 @@ TRIPLE(T1) adfunc
 }
 
 
+// as above, where f has no data
+template <class T1,class T2>
+TRIPLE(T1) adfunc
+(const FUNCTION(T2)& f,const MULTIARG(T1)& xs,unsigned int order = 2,ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO)
+{
+  return adfunc(f,xs,MULTIARG(T1)(),order,mode);
+}
+
+
 
 
 template <class T1,class T2>
@@ -169,96 +405,26 @@ template <class T1,class T2>
   typedef TENSOR(T1) Tensor_Type_1;
   typedef TRIPLE(T1) Triple_Type_1;
 
-  unsigned int num_xs = xs.size();
-  typename MultiArg_Type_1::const_iterator it_xs = xs.begin();
-  typename MultiArg_Type_1::const_iterator it_xs_end = xs.end();
-
-  // determine size of AD vector for use with ADfun and INdependent
-  unsigned int xs_AD_vec_size = 0;
-  while(it_xs != it_xs_end)
-    {
-      xs_AD_vec_size += (*it_xs).rows()*(*it_xs).cols() ;
-      it_xs++;
-    }
   // create an AD vector for use with ADfun and Independent
-  std::vector<T2> a_vec_x(xs_AD_vec_size);
+  std::vector<T2> a_vec_x;
+  adfunc_flatten(xs,a_vec_x);
   // create a vector representing the point at which the jacobian and hessian will be calculated
-  std::vector<T1> eval_point(xs_AD_vec_size);
-  // populate the vectors
-  it_xs = xs.begin();
-  unsigned int cursor = 0;
-  while(it_xs != it_xs_end)
-    {
-      unsigned int x_nrows = (*it_xs).rows();
-      unsigned int x_ncols = (*it_xs).cols();
-      for(int row = 0; row < x_nrows; row++)
-	{
-	  for(int col = 0; col < x_ncols; col++)
-	    { 
-	      a_vec_x[cursor] = eval_point[cursor] = (*it_xs)(row,col);
-	      cursor++;
-	    }
-	}
-      it_xs++;
-    }
+  std::vector<T1> eval_point;
+  adfunc_flatten(xs,eval_point);
  
   // start the tape recording
   CppAD::Independent(a_vec_x);
   
   // wrap the vector into an aMat for dispatching to f
-  std::vector<Matrix_Type_2 > a_xs(num_xs);
-  it_xs = xs.begin();
-  cursor = 0;
-  unsigned int xs_entry = 0;
-  while(it_xs != it_xs_end)
-    {
-      unsigned int x_nrows = (*it_xs).rows();
-      unsigned int x_ncols = (*it_xs).cols();
-      Matrix_Type_2 a_mat_x(x_nrows,x_ncols);
-      for(int row = 0; row < x_nrows; row++)
-	{
-	  for(int col = 0; col < x_ncols; col++)
-	    { 
-	      a_mat_x(row,col) = a_vec_x[cursor++];
-	    }
-	}
-      a_xs[xs_entry++] = a_mat_x;
-      *it_xs++;
-    }
+  std::vector<Matrix_Type_2 > a_xs;
+  adfunc_unflatten(a_vec_x,xs,a_xs);
   
   // dispatch to f
   std::vector<Matrix_Type_2 > a_ys = f(a_xs);
 
-  // unwrap the result into a vector for the tape and a matrix for the result
-  unsigned int num_a_ys = a_ys.size();
-  typename std::vector<Matrix_Type_2 >::const_iterator it_a_ys = a_ys.begin();
-  typename std::vector<Matrix_Type_2 >::const_iterator it_a_ys_end = a_ys.end();
-  // determine size of AD vector for use with ADfun and INdependent
-  unsigned int a_ys_AD_vec_size = 0;
-  while(it_a_ys != it_a_ys_end)
-    {
-      a_ys_AD_vec_size += (*it_a_ys).rows()*(*it_a_ys).cols() ;
-      it_a_ys++;
-    }
-  // create an AD vector for use with ADfun and Independent
-  std::vector<T2> a_vec_y(a_ys_AD_vec_size);
-
- 
-  it_a_ys = a_ys.begin();
-  cursor = 0;
-  while(it_a_ys != it_a_ys_end)
-    {
-      unsigned int y_nrows = (*it_a_ys).rows();
-      unsigned int y_ncols = (*it_a_ys).cols();
-      for(int row = 0; row < y_nrows; row++)
-	{
-	  for(int col = 0; col < y_ncols; col++)
-	    { 
-	      a_vec_y[cursor++] = (*it_a_ys)(row,col);
-	    }
-	}
-      it_a_ys++;
-    }
+  // unwrap the result into a vector for the tape
+  std::vector<T2> a_vec_y;
+  adfunc_flatten(a_ys,a_vec_y);
 
   // process the tape
   CppAD::ADFun<T1> f_tape; 
@@ -268,36 +434,10 @@ template <class T1,class T2>
   Independent(eval_point);
   eval_point_copy = eval_point; // retain a copy for use by posterior
 
-  // calculate the Jacobian
-  std::vector<T1> v_jacobian = f_tape.Jacobian(eval_point);  // TODO -will need to do this across additional directions later
-
-  // unwrap into the jacobian
-  Matrix_Type_1 jacobian(a_ys_AD_vec_size,xs_AD_vec_size);
-  cursor = 0;
-  for(int row = 0; row < a_ys_AD_vec_size; row++)
-    {
-      for(int col = 0; col < xs_AD_vec_size; col++)
-        { 
-	  jacobian(row,col) = v_jacobian[cursor++];
-    
-        }
-    }
-  
-  Tensor_Type_1 hessians(1,a_ys_AD_vec_size);  
-  for(int d = 0; d < a_ys_AD_vec_size; d++)
-    {
-      std::vector<T1> v_hessian = f_tape.Hessian(eval_point,d);  
-      Matrix_Type_1 hessian(xs_AD_vec_size,xs_AD_vec_size);
-      cursor = 0;
-      for(int row = 0; row < xs_AD_vec_size; row++)
-	{
-	  for(int col = 0; col < xs_AD_vec_size; col++)
-	    {
-	      hessian(row,col) = v_hessian[cursor++]; 
-	    } 
-	  hessians(0,d) = hessian;
-	}
-    }
+  // calculate the derivatives
+  Matrix_Type_1 jacobian;
+  Tensor_Type_1 hessians;
+  adfunc_derivatives(f_tape,eval_point,jacobian,hessians);
  
   // result matrices
   unsigned int num_ys = a_ys.size();
@@ -316,26 +456,11 @@ template <class T1,class T2>
   TRIPLE(T1) adfunc_posterior(const FUNCTION(T2)& f,const MULTIARG(T2)& xs,std::vector<T2>& eval_point_copy)
 {
   typedef MULTIARG(T1) MultiArg_Type_1;
-  typedef MULTIARG(T2) MultiArg_Type_2;
   typedef MATRIX(T1) Matrix_Type_1; 
   typedef MATRIX(T2) Matrix_Type_2; 
   typedef TENSOR(T1) Tensor_Type_1;
   typedef TRIPLE(T1) Triple_Type_1;
 
-  unsigned int num_xs = xs.size();
-
-  typename MultiArg_Type_2::const_iterator it_xs = xs.begin();
-  typename MultiArg_Type_2::const_iterator it_xs_end = xs.end();
-
-  // determine size of AD vector for use with ADfun and INdependent
-  unsigned int xs_AD_vec_size = 0;
-  while(it_xs != it_xs_end)
-    {
-      xs_AD_vec_size += (*it_xs).rows()*(*it_xs).cols() ;
-      it_xs++;
-    }
-  // create an AD vector for use with ADfun and Independent
-  std::vector<T2> a_vec_x(xs_AD_vec_size);
   // create a vector representing the point at which the jacobian and hessian will be calculated 
   // populated from the PRIOR evaluation point
   std::vector<T1> eval_point(eval_point_copy.size());
@@ -344,81 +469,14 @@ template <class T1,class T2>
       eval_point[i] = Value(eval_point_copy[i]);
     }
 
-
-  // populate the vectors
-  it_xs = xs.begin();
-  unsigned int cursor = 0;
-  while(it_xs != it_xs_end)
-    {
-      unsigned int x_nrows = (*it_xs).rows();
-      unsigned int x_ncols = (*it_xs).cols();
-      for(int row = 0; row < x_nrows; row++)
-	{
-	  for(int col = 0; col < x_ncols; col++)
-	    { 
-	      a_vec_x[cursor] = (*it_xs)(row,col);
-	      cursor++;
-	    }
-	}
-      it_xs++;
-    }
- 
   // POSTERIOR the tape is already recording
   
-  // wrap the vector into an aMat for dispatching to f
-  std::vector<Matrix_Type_2 > a_xs(num_xs);
-  it_xs = xs.begin();
-  cursor = 0;
-  unsigned int xs_entry = 0;
-  while(it_xs != it_xs_end)
-    {
-      unsigned int x_nrows = (*it_xs).rows();
-      unsigned int x_ncols = (*it_xs).cols();
-      Matrix_Type_2 a_mat_x(x_nrows,x_ncols);
-      for(int row = 0; row < x_nrows; row++)
-	{
-	  for(int col = 0; col < x_ncols; col++)
-	    { 
-	      a_mat_x(row,col) = a_vec_x[cursor++];
-	    }
-	}
-      a_xs[xs_entry++] = a_mat_x;
-      *it_xs++;
-    }
-  
   // dispatch to f
-  std::vector<Matrix_Type_2 > a_ys = f(a_xs);
+  std::vector<Matrix_Type_2 > a_ys = f(xs);
 
-  // unwrap the result into a vector for the tape and a matrix for the result
-  unsigned int num_a_ys = a_ys.size();
-  typename std::vector<Matrix_Type_2 >::const_iterator it_a_ys = a_ys.begin();
-  typename std::vector<Matrix_Type_2 >::const_iterator it_a_ys_end = a_ys.end();
-  // determine size of AD vector for use with ADfun and INdependent
-  unsigned int a_ys_AD_vec_size = 0;
-  while(it_a_ys != it_a_ys_end)
-    {
-      a_ys_AD_vec_size += (*it_a_ys).rows()*(*it_a_ys).cols() ;
-      it_a_ys++;
-    }
-  // create an AD vector for use with ADfun and Independent
-  std::vector<T2> a_vec_y(a_ys_AD_vec_size);
-
- 
-  it_a_ys = a_ys.begin();
-  cursor = 0;
-  while(it_a_ys != it_a_ys_end)
-    {
-      unsigned int y_nrows = (*it_a_ys).rows();
-      unsigned int y_ncols = (*it_a_ys).cols();
-      for(int row = 0; row < y_nrows; row++)
-	{
-	  for(int col = 0; col < y_ncols; col++)
-	    { 
-	      a_vec_y[cursor++] = (*it_a_ys)(row,col);
-	    }
-	}
-      it_a_ys++;
-    }
+  // unwrap the result into a vector for the tape
+  std::vector<T2> a_vec_y;
+  adfunc_flatten(a_ys,a_vec_y);
 
   // process the tape
   CppAD::ADFun<T1> f_tape;
@@ -427,39 +485,10 @@ template <class T1,class T2>
 
   // this is POSTERIOR - Independent already implemented in PRIOR
 
-  // calculate the Jacobian
-  std::vector<T1> v_jacobian = f_tape.Jacobian(eval_point);  // TODO -will need to do this across additional directions later
-
-  // using the eval point for size of the domain - adjust the size of jacobian and hessians accordingly
-  xs_AD_vec_size = eval_point_copy.size();
-  // unwrap into the jacobian
-  Matrix_Type_1 jacobian(a_ys_AD_vec_size,xs_AD_vec_size);
-  cursor = 0;
-  for(int row = 0; row < a_ys_AD_vec_size; row++)
-    {
-      for(int col = 0; col < xs_AD_vec_size; col++)
-        { 
-	  jacobian(row,col) = v_jacobian[cursor++];
-    
-        }
-    }
-  
-  // unwrp into the hessians
-  Tensor_Type_1 hessians(1,a_ys_AD_vec_size);  
-  for(int d = 0; d < a_ys_AD_vec_size; d++)
-    {
-      std::vector<T1> v_hessian = f_tape.Hessian(eval_point,d);  
-      Matrix_Type_1 hessian(xs_AD_vec_size,xs_AD_vec_size);
-      cursor = 0;
-      for(int row = 0; row < xs_AD_vec_size; row++)
-	{
-	  for(int col = 0; col < xs_AD_vec_size; col++)
-	    {
-	      hessian(row,col) = v_hessian[cursor++]; 
-	    } 
-	  hessians(0,d) = hessian;
-	}
-    }
+  // calculate the derivatives
+  Matrix_Type_1 jacobian;
+  Tensor_Type_1 hessians;
+  adfunc_derivatives(f_tape,eval_point,jacobian,hessians);
  
   // result matrices
   unsigned int num_ys = a_ys.size();
@@ -5,8 +5,10 @@
 
 #include "cppad.eigen.h"
 #include "adfunc.h"
+#include "adfunc-cache.h"
 #include <boost/function.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <vector>
 
 
 template <class T>
@@ -15,45 +17,58 @@ boost::tuple<MATRIX(T),MATRIX(T),TENSOR(T) > compose(const boost::tuple<MATRIX(T
 
 {
 
-  // NB - THIS IS WORK IN PROGRESS - ONLY APPLIES TH THE CASE   g:R^n->R^m and f:R^m->R
+  // g:R^n->R^m and f:R^m->R^p
 
   typedef  MATRIX(T) Matrix_Type_T;
   typedef  TENSOR(T) Tensor_Type_T;
 
   // get jacobians and hessians for f and g
-  MATRIX(T) jac_g = boost::get<1>(g); // g.get<1>();
-  MATRIX(T) jac_f = boost::get<1>(f); //f.get<1>(); 
-  MATRIX(T) hess_f = boost::get<2>(f)(0,0); // f.get<2>()(0,0); // know that there is only one hessian for f - see note above)
+  const MATRIX(T)& jac_g = boost::get<1>(g);
+  const MATRIX(T)& jac_f = boost::get<1>(f);
+  const TENSOR(T)& hess_f = boost::get<2>(f);
+  const TENSOR(T)& hess_g = boost::get<2>(g);
 
-  // work out the dimensions (using the jacobian of g)
+  // work out the dimensions (using the jacobians)
   unsigned int n = jac_g.cols();
   unsigned int m = jac_g.rows();
+  unsigned int p = jac_f.rows();
 
   // chain rule for jacobians
   MATRIX(T) jacobian = jac_f*jac_g;
 
-  // implement Faa di Bruno's formula for second derivatives (y \in R only for now - see note above)
-  // configure result
-  MATRIX(T) hessian(n,n);
-  hessian.setZero();
-  for(int i = 0; i < n; i++)
+  // implement Faa di Bruno's formula for second derivatives, for each output q of f
+  //   H_q = Jg^T Hf_q Jg + sum_k Jf_qk Hg_k
+  // the p hessians are formed together with a few large matrix products rather than element by element
+  // Hf_q Jg for every q, with the hessians of f stacked vertically
+  MATRIX(T) hess_f_stacked(p*m,m);
+  for(unsigned int q = 0; q < p; q++)
     {
-      for(int j = 0; j < n; j++)
-	{
-	  for(int k = 0; k < m; k++)
-	    {
-	      MATRIX(T) hess_g_k = boost::get<2>(g)(0,k); // g.get<2>()(0,k);
-	      hessian(i,j) = hessian(i,j) + jac_f(0,k)*hess_g_k(i,j); 
-	      for(int l = 0; l < m; l++)
-		{
-		  hessian(i,j) = hessian(i,j) + hess_f(k,l)*jac_g(k,i)*jac_g(l,j);
-		}
-	    }
-	} 
+      hess_f_stacked.block(q*m,0,m,m) = hess_f(0,q);
     }
+  MATRIX(T) hess_f_jac_g;
+  hess_f_jac_g.noalias() = hess_f_stacked*jac_g;
+  // Jg^T Hf_q Jg for every q, with the products above side by side
+  MATRIX(T) hess_f_jac_g_side(m,p*n);
+  for(unsigned int q = 0; q < p; q++)
+    {
+      hess_f_jac_g_side.block(0,q*n,m,n) = hess_f_jac_g.block(q*m,0,m,n);
+    }
+  MATRIX(T) first_terms;
+  first_terms.noalias() = jac_g.transpose()*hess_f_jac_g_side;
+  // sum_k Jf_qk Hg_k for every q, with the hessians of g flattened into the columns of a matrix
+  MATRIX(T) hess_g_flat(n*n,m);
+  for(unsigned int k = 0; k < m; k++)
+    {
+      hess_g_flat.col(k) = Eigen::Map<const Matrix<T,Dynamic,1> >(hess_g(0,k).data(),n*n);
+    }
+  MATRIX(T) second_terms;
+  second_terms.noalias() = hess_g_flat*jac_f.transpose();
 
-  TENSOR(T) hessians(1,1);
-  hessians(0,0) = hessian;
+  TENSOR(T) hessians(1,p);
+  for(unsigned int q = 0; q < p; q++)
+    {
+      hessians(0,q) = first_terms.block(0,q*n,n,n) + Eigen::Map<const MATRIX(T)>(second_terms.col(q).data(),n,n);
+    }
   boost::tuple<Matrix_Type_T,Matrix_Type_T,Tensor_Type_T> result = boost::make_tuple(boost::get<0>(f),jacobian,hessians);
   // boost::tuple<Mat,Mat,Tensor> result = boost::make_tuple(f.get<0>(),jacobian,hessians);
   return result;
@@ -79,15 +94,10 @@ boost::tuple<MATRIX(T),MATRIX(T),TENSOR(T)> compose(const boost::tuple<MATRIX(T)
   unsigned int cursor = 0;
   for(unsigned int i = 0; i < num_ys; i++)
     {
-      unsigned int n_rows = boost::get<0>(g)[i].rows();
-      unsigned int n_cols = boost::get<0>(g)[i].cols();
-      for(unsigned int r = 0; r < n_rows; r++)
-	{
-	  for(unsigned int c = 0; c < n_cols; c++)
-	    {
-	      y_star(0,cursor++) = boost::get<0>(g)[i](r,c);
-	    }
-	}
+      // flattened column by column, as in adfunc_flatten
+      unsigned int size = boost::get<0>(g)[i].size();
+      y_star.block(0,cursor,1,size) = Eigen::Map<const MATRIX(T)>(boost::get<0>(g)[i].data(),1,size);
+      cursor += size;
     }
   boost::tuple<MATRIX(T),MATRIX(T),TENSOR(T)> g_star = boost::make_tuple(y_star,boost::get<1>(g),boost::get<2>(g));
   return compose(f,g_star);
@@ -129,4 +139,198 @@ TRIPLE(T1) compose(const FUNCTION(T2)& f,
 }
 
 
+// f(g(xs)), for recording the composition
+template <class T2>
+MULTIARG(T2) compose_call(const FUNCTION(T2)& f,const FUNCTION(T2)& g,const MULTIARG(T2)& xs)
+{
+  return f(g(xs));
+}
+
+
+// the composition of f and g as a single function
+template <class T2>
+FUNCTION(T2) compose_function(const FUNCTION(T2)& f,const FUNCTION(T2)& g)
+{
+  return boost::bind(compose_call<T2>,f,g,_1);
+}
+
+
+// the value of f o g at xs and its derivatives up to order from a single tape on which g and then f
+// are recorded. Unlike composing the derivatives of f and g above, the jacobian and hessians of g
+// are never formed, so only the derivatives of the composition that are asked for are calculated
+template <class T1, class T2>
+TRIPLE(T1) compose_tape(const FUNCTION(T2)& f, 
+			const FUNCTION(T2)& g,
+			const MULTIARG(T1)& xs,
+			unsigned int order = 2,
+			ADFUNC_JACOBIAN_MODE mode = ADFUNC_JACOBIAN_AUTO)
+{
+  return adfunc(compose_function(f,g),xs,order,mode);
+}
+
+
+// the product of the matrices ms[i] to ms[j] (which are in order of multiplication) in the
+// association given by split (see compose_chain_product)
+template <class T>
+MATRIX(T) compose_chain_multiply(const std::vector<const MATRIX(T)*>& ms,const std::vector<std::vector<unsigned int> >& split,
+				 unsigned int i,unsigned int j)
+{
+  if(i == j)
+    {
+      return *ms[i];
+    }
+  unsigned int k = split[i][j];
+  MATRIX(T) product;
+  product.noalias() = compose_chain_multiply<T>(ms,split,i,k)*compose_chain_multiply<T>(ms,split,k+1,j);
+  return product;
+}
+
+
+// the product J_{N-1} ... J_1 J_0 of the jacobians of the stages of a chain, associated so that the
+// number of multiplications is least given the dimensions of the jacobians (matrix chain ordering)
+template <class T>
+MATRIX(T) compose_chain_product(const std::vector<MATRIX(T)>& jacobians)
+{
+  unsigned int num_ms = jacobians.size();
+  // in order of multiplication, ms[i] is dims[i] x dims[i+1]
+  std::vector<const MATRIX(T)*> ms(num_ms);
+  std::vector<double> dims(num_ms+1);
+  for(unsigned int i = 0; i < num_ms; i++)
+    {
+      ms[i] = &jacobians[num_ms-1-i];
+      dims[i] = ms[i]->rows();
+    }
+  dims[num_ms] = ms[num_ms-1]->cols();
+  std::vector<std::vector<double> > cost(num_ms,std::vector<double>(num_ms,0.0));
+  std::vector<std::vector<unsigned int> > split(num_ms,std::vector<unsigned int>(num_ms,0));
+  for(unsigned int length = 1; length < num_ms; length++)
+    {
+      for(unsigned int i = 0; i + length < num_ms; i++)
+	{
+	  unsigned int j = i + length;
+	  cost[i][j] = -1.0;
+	  for(unsigned int k = i; k < j; k++)
+	    {
+	      double c = cost[i][k] + cost[k+1][j] + dims[i]*dims[k+1]*dims[j+1];
+	      if(cost[i][j] < 0.0 || c < cost[i][j])
+		{
+		  cost[i][j] = c;
+		  split[i][j] = k;
+		}
+	    }
+	}
+    }
+  return compose_chain_multiply<T>(ms,split,0,num_ms-1);
+}
+
+
+// the value of the chain of functions fs at xs and its derivatives up to order, where fs[0] is applied
+// first, ie fs[N-1] o ... o fs[1] o fs[0]. The tape of each stage is taken from the cache of adfunc_cached
+// (so it is recorded once per function and shape of its input and only swept on later calls), or is
+// recorded for the call when the function has no identity (see adfunc_cached). A tape may be shared
+// by more than one stage, so every sweep of a stage starts with a zero order sweep at its own input.
+// The jacobian (order 1) is the product of the jacobians of the stages, associated according to their
+// dimensions. For the hessians (order 2) the derivatives of the outputs of the chain with respect to
+// the input of each stage are propagated backwards from the last stage. With S_i the part of the
+// chain from stage i and J_i the jacobian of stage i
+//   J(S_i) = J(S_{i+1}) J_i
+//   H(S_i)_q = J_i^T H(S_{i+1})_q J_i + sum_k J(S_{i+1})_qk H_ik
+// where the second term is the hessian of the outputs of stage i weighted by the qth row of J(S_{i+1}),
+// which is swept directly from the tape of the stage (giving the qth row of J(S_i) too), so the
+// hessians of the intermediate stages are never formed. The association is fixed for order 2 as the
+// weighted hessians of a stage need the jacobian of the rest of the chain after it.
+template <class T1, class T2>
+TRIPLE(T1) compose_chain(const std::vector<FUNCTION(T2)>& fs,const MULTIARG(T1)& xs,unsigned int order = 2)
+{
+  unsigned int num_stages = fs.size();
+  MATRIX(T1) jacobian;
+  TENSOR(T1) hessians;
+  MULTIARG(T1) ys = xs;
+  if(order == 0)
+    {
+      for(unsigned int i = 0; i < num_stages; i++)
+	{
+	  MULTIARG(T1) xs_i = ys;
+	  adfunc_evaluate(fs[i],xs_i,ys);
+	}
+      return boost::make_tuple(ys,jacobian,hessians);
+    }
+
+  // the tape of each stage at its input
+  ADFunCache<T1,T2>& cache = CGenericSingleton<ADFunCache<T1,T2> >::Instance();
+  std::vector<typename ADFunCache<T1,T2>::Tape_Type> tapes(num_stages);
+  std::vector<std::vector<T1> > eval_points(num_stages);
+  for(unsigned int i = 0; i < num_stages; i++)
+    {
+      adfunc_flatten(ys,eval_points[i]);
+      const void* id = adfunc_identity(fs[i]);
+      MULTIARG(T1) ys_i;
+      if(id != 0)
+	{
+	  tapes[i] = cache.tape(fs[i],ys,id,ys_i);
+	}
+      else
+	{
+	  tapes[i].reset(new ADTape<T1>);
+	  MULTIARG(T2) a_ys;
+	  adfunc_record(fs[i],ys,tapes[i]->f_tape,a_ys);
+	  ys_i.resize(a_ys.size());
+	  for(unsigned int j = 0; j < a_ys.size(); j++)
+	    {
+	      ys_i[j] = Convert<MATRIX(T1)>(a_ys[j]);
+	    }
+	}
+      ys.swap(ys_i);
+    }
+  if(num_stages == 0)
+    {
+      return boost::make_tuple(ys,jacobian,hessians);
+    }
+
+  if(order == 1)
+    {
+      std::vector<MATRIX(T1)> jacobians(num_stages);
+      for(unsigned int i = 0; i < num_stages; i++)
+	{
+	  adfunc_jacobian(tapes[i]->f_tape,eval_points[i],jacobians[i]);
+	}
+      jacobian = compose_chain_product(jacobians);
+      return boost::make_tuple(ys,jacobian,hessians);
+    }
+
+  // propagate backwards from the last stage, where J(S_N) is the identity and H(S_N) is zero
+  unsigned int num_outputs = tapes[num_stages-1]->f_tape.Range();
+  jacobian = MATRIX(T1)::Identity(num_outputs,num_outputs);
+  hessians.resize(1,num_outputs);
+  for(int i = num_stages-1; i >= 0; i--)
+    {
+      CppAD::ADFun<T1>& f_tape = tapes[i]->f_tape;
+      unsigned int domain_size = f_tape.Domain();
+      TENSOR(T1) weighted_hessians(1,num_outputs);
+      for(unsigned int q = 0; q < num_outputs; q++)
+	{
+	  weighted_hessians(0,q).resize(domain_size,domain_size);
+	}
+      MATRIX(T1) next_jacobian(num_outputs,domain_size);
+      f_tape.Forward(0,eval_points[i]);
+      for(unsigned int col = 0; col < domain_size; col++)
+	{
+	  adfunc_hessians_col(f_tape,col,weighted_hessians,&next_jacobian,0,&jacobian);
+	}
+      if(i < (int) num_stages-1)
+	{
+	  MATRIX(T1) stage_jacobian;
+	  adfunc_jacobian(f_tape,eval_points[i],stage_jacobian);
+	  for(unsigned int q = 0; q < num_outputs; q++)
+	    {
+	      weighted_hessians(0,q).noalias() += stage_jacobian.transpose()*(hessians(0,q)*stage_jacobian);
+	    }
+	}
+      hessians.swap(weighted_hessians);
+      jacobian.swap(next_jacobian);
+    }
+  return boost::make_tuple(ys,jacobian,hessians);
+}
+
+
 #endif
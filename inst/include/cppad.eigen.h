@@ -59,6 +59,96 @@ typedef TYPELIST_10(Mat_0,Mat_1,Mat_2,Mat_3,Mat_4,Mat_5,Mat_6,Mat_7,Mat_8,Mat_9)
 
 
 
+// allow expressions that mix matrices of AD<Base> and Base, eg the product of a matrix of data (double)
+// with a matrix of AD<double>, without first converting the data to AD<Base>. The data are then constants
+// of the expression and are not stored as AD<Base> objects.
+namespace Eigen {
+  template <class Base,class BinaryOp> struct ScalarBinaryOpTraits<CppAD::AD<Base>,Base,BinaryOp>
+  {
+    typedef CppAD::AD<Base> ReturnType;
+  };
+  template <class Base,class BinaryOp> struct ScalarBinaryOpTraits<Base,CppAD::AD<Base>,BinaryOp>
+  {
+    typedef CppAD::AD<Base> ReturnType;
+  };
+
+  namespace internal {
+    // Eigen's blocked (gebp) matrix product kernel needs both operands to have the same scalar type, so the
+    // product of a matrix of Base with a matrix of AD<Base> is calculated directly - each element of the
+    // result is recorded as a sum of products of its AD<Base> operands with constants
+    template <class Index,class LhsScalar,int LhsStorageOrder,class RhsScalar,int RhsStorageOrder>
+    struct mixed_ad_gemm
+    {
+      typedef typename ScalarBinaryOpTraits<LhsScalar,RhsScalar>::ReturnType ResScalar;
+      static void run(Index rows,Index cols,Index depth,const LhsScalar* lhs,Index lhsStride,const RhsScalar* rhs,Index rhsStride,
+		      ResScalar* res,Index resIncr,Index resStride,const ResScalar& alpha)
+      {
+	for(Index j = 0; j < cols; j++)
+	  {
+	    for(Index i = 0; i < rows; i++)
+	      {
+		ResScalar sum(0.0);
+		for(Index k = 0; k < depth; k++)
+		  {
+		    sum += lhs[LhsStorageOrder == ColMajor ? i+k*lhsStride : i*lhsStride+k]*rhs[RhsStorageOrder == ColMajor ? k+j*rhsStride : k*rhsStride+j];
+		  }
+		res[i*resIncr+j*resStride] += CppAD::IdenticalOne(alpha) ? sum : alpha*sum;
+	      }
+	  }
+      }
+    };
+
+#if EIGEN_VERSION_AT_LEAST(3,3,90)
+#define MIXED_AD_GEMM(LHS,RHS)						\
+    template <class Index,class Base,int LhsStorageOrder,bool ConjugateLhs,int RhsStorageOrder,bool ConjugateRhs,int ResInnerStride> \
+    struct general_matrix_matrix_product<Index,LHS,LhsStorageOrder,ConjugateLhs,RHS,RhsStorageOrder,ConjugateRhs,ColMajor,ResInnerStride> \
+    {									\
+      typedef gebp_traits<LHS,RHS> Traits;				\
+      typedef CppAD::AD<Base> ResScalar;				\
+      static void run(Index rows,Index cols,Index depth,const LHS* lhs,Index lhsStride,const RHS* rhs,Index rhsStride, \
+		      ResScalar* res,Index resIncr,Index resStride,ResScalar alpha,level3_blocking<LHS,RHS>&,GemmParallelInfo<Index>* = 0) \
+      {									\
+	mixed_ad_gemm<Index,LHS,LhsStorageOrder,RHS,RhsStorageOrder>::run(rows,cols,depth,lhs,lhsStride,rhs,rhsStride,res,resIncr,resStride,alpha); \
+      }									\
+    };
+#else
+#define MIXED_AD_GEMM(LHS,RHS)						\
+    template <class Index,class Base,int LhsStorageOrder,bool ConjugateLhs,int RhsStorageOrder,bool ConjugateRhs> \
+    struct general_matrix_matrix_product<Index,LHS,LhsStorageOrder,ConjugateLhs,RHS,RhsStorageOrder,ConjugateRhs,ColMajor> \
+    {									\
+      typedef gebp_traits<LHS,RHS> Traits;				\
+      typedef CppAD::AD<Base> ResScalar;				\
+      static void run(Index rows,Index cols,Index depth,const LHS* lhs,Index lhsStride,const RHS* rhs,Index rhsStride, \
+		      ResScalar* res,Index resStride,ResScalar alpha,level3_blocking<LHS,RHS>&,GemmParallelInfo<Index>* = 0) \
+      {									\
+	mixed_ad_gemm<Index,LHS,LhsStorageOrder,RHS,RhsStorageOrder>::run(rows,cols,depth,lhs,lhsStride,rhs,rhsStride,res,1,resStride,alpha); \
+      }									\
+    };
+#endif
+
+    MIXED_AD_GEMM(CppAD::AD<Base>,Base)
+    MIXED_AD_GEMM(Base,CppAD::AD<Base>)
+#undef MIXED_AD_GEMM
+
+    // the product of a matrix of AD<Base> with a vector of Base converts the scale factor of the product (1 unless
+    // the matrix is a scaled expression) to Base, which is only possible when it is not a variable
+    template <class Base> struct get_factor<CppAD::AD<Base>,Base>
+    {
+      static Base run(const CppAD::AD<Base>& x)
+      {
+	if(CppAD::Variable(x))
+	  {
+	    CppAD::ErrorHandler::Call(true,__LINE__,__FILE__,"CppAD::Parameter(x)",
+				      "the product of a matrix of AD<Base> scaled by a variable with a vector of Base is not supported");
+	  }
+	return CppAD::Value(x);
+      }
+    };
+  }
+}
+
+
+
 
 
 template <bool b>
@@ -116,18 +206,18 @@ return asADN_impl<T1,T2,ScalarTypes,Difference>::doit(in);
 }
 
 
+// conversions between the matrix types. Demoting takes the value of each element (as many times as
+// there are levels between the scalar types) and promoting assigns each element, which records it as a
+// parameter. The conversion is chosen at compile time from the positions of the types in MatTypes.
 template <class Tout,class Tin>
 Tout Demoter(const Tin& in)
 {
-unsigned int nrows = in.rows();
-unsigned int ncols = in.cols();
-Tout out(nrows,ncols);
-for(unsigned int i = 0; i < nrows; i++)
+typedef typename TypeAt<ScalarTypes,IndexOf<MatTypes,Tout>::Value>::Result Scalar_Out_Type;
+Tout out(in.rows(),in.cols());
+unsigned int size = in.size();
+for(unsigned int k = 0; k < size; k++)
   {
-    for(unsigned int j = 0; j < ncols; j++)
-     {
-       out(i,j) = asADN<typename TypeAt<ScalarTypes,IndexOf<MatTypes,Tout>::Value>::Result>(in(i,j));
-     }    
+    out.data()[k] = asADN<Scalar_Out_Type>(in.data()[k]);
   }
 return out;
 }
@@ -135,113 +225,44 @@ return out;
 template <class Tout,class Tin>
 Tout Promoter(const Tin& in)
 {
-unsigned int nrows = in.rows();
-unsigned int ncols = in.cols();
-Tout out(nrows,ncols);
-for(unsigned int i = 0; i < nrows; i++)
+Tout out(in.rows(),in.cols());
+unsigned int size = in.size();
+for(unsigned int k = 0; k < size; k++)
   {
-    for(unsigned int j = 0; j < ncols; j++)
-     {
-       out(i,j) = in(i,j);
-     }    
+    out.data()[k] = in.data()[k];
   }
 return out;
-
 }
 
-template <class Tout,class Tin>
-Tin Retainer(const Tin& in)
-{
-return in;
-}
-
-
-
-template <class TList,template <class,class> class Unit> class PairWithSelf;
-
-template <class T1,class T2,class T3,template <class,class> class Unit> 
-class PairWithSelf<Typelist<T1,Typelist<T2,T3> >,Unit>  : public PairWithSelf<Typelist<T2,T3>,Unit> , public Unit<T1,T1> {};
-
-template <class T1,class T2,template <class,class> class Unit> 
-class PairWithSelf<Typelist<T1,Typelist<T2,NullType> >,Unit>  : public Unit<T1,T1> , public Unit<T2,T2> {};
-
-
-template <class TList,template <class,class> class Unit> class PairRootWithAllAndBranch;
-                                                               
-template <class TList,template <class,class> class Unit> class PairRootWithAll;
-
 
-template <class T1,class T2,class T3,template <class,class> class Unit> 
-class PairRootWithAllAndBranch<Typelist<T1,Typelist<T2,T3> >,Unit> : public PairRootWithAll<Typelist<T1,T3>,Unit>, 
-								     public PairRootWithAllAndBranch<Typelist<T2,T3>,Unit>, 
-								     public Unit<T1,T2>,
-								     public Unit<T2,T1>
-{
-  public:
-  PairRootWithAllAndBranch() : Unit<T1,T2>(boost::function<T1 (const T2&)>(Demoter<T1,T2>))  ,
-			       Unit<T2,T1>(boost::function<T2 (const T1&)>(Promoter<T2,T1>)) {}
-};
-
-
-template <class T1,class T2,template <class,class> class Unit> 
-class PairRootWithAllAndBranch<Typelist<T1,Typelist<T2,NullType> >,Unit> :  public Unit<T1,T2> , 
-									    public Unit<T2,T1>
+template <class Tout,class Tin,bool Demote = ((int) IndexOf<MatTypes,Tout>::Value < (int) IndexOf<MatTypes,Tin>::Value)>
+class Conversion
 {
 public:
-  PairRootWithAllAndBranch() : Unit<T1,T2>(boost::function<T1 (const T2&)>(Demoter<T1,T2>)) ,
-			       Unit<T2,T1>(boost::function<T2 (const T1&)>(Promoter<T2,T1>)) {}
-};
-
-
-template <class T1,class T2,class T3,template <class,class> class Unit> 
-class PairRootWithAll<Typelist<T1,Typelist<T2,T3> >,Unit> : public PairRootWithAll<Typelist<T1,T3>,Unit>, 
-							    public Unit<T1,T2>,
-							    public Unit<T2,T1>
-{
-  public:
-  PairRootWithAll() : Unit<T1,T2>(boost::function<T1 (const T2&)>(Demoter<T1,T2>))  ,
-                          Unit<T2,T1>(boost::function<T2 (const T1&)>(Promoter<T2,T1>)) {}
+  static Tout Method(const Tin& in) { return Promoter<Tout,Tin>(in); }
 };
 
-
-template <class T1,class T2,template <class,class> class Unit> 
-class PairRootWithAll<Typelist<T1,Typelist<T2,NullType> >,Unit> :  public Unit<T1,T2> , 
-								   public Unit<T2,T1>
+template <class Tout,class Tin>
+class Conversion<Tout,Tin,true>
 {
 public:
-  PairRootWithAll() : Unit<T1,T2>(boost::function<T1 (const T2&)>(Demoter<T1,T2>)) ,
-		      Unit<T2,T1>(boost::function<T2 (const T1&)>(Promoter<T2,T1>)) {}
+  static Tout Method(const Tin& in) { return Demoter<Tout,Tin>(in); }
 };
 
-
-
-template <class TList,template <class,class> class Unit> 
-class Converter : public PairRootWithAllAndBranch<TList,Unit> , public PairWithSelf<TList,Unit> {};
-
-
-template <class T1, class T2>
-class ConverterImpl
+// the same type is a plain (vectorized) copy
+template <class T>
+class Conversion<T,T,false>
 {
-private:
-  boost::function<T1 (const T2&)> m_method;  
 public:
-  T1 Method(const T2& in) { return m_method(in); }
-  ConverterImpl()   
-  {
-    m_method = boost::function<T1 (const T2&)>(Retainer<T1,T2>);
-  }
-  ConverterImpl(boost::function<T1 (const T2&)> method) 
-  {
-    m_method = method;
-  }
-
+  static const T& Method(const T& in) { return in; }
 };
 
+
+// convert in to out_type - there is no shared state so this can be called from any thread
 template <class out_type,class in_type>
-out_type Convert(const in_type& in)
+inline out_type Convert(const in_type& in)
 {
-Converter<MatTypes,ConverterImpl>& c = CGenericSingleton<Converter<MatTypes,ConverterImpl> >::Instance();
-return c.ConverterImpl<out_type,in_type>::Method(in);
+return Conversion<out_type,in_type>::Method(in);
 }
 
 
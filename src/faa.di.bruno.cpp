@@ -41,49 +41,41 @@ Rcpp::List marshal_faa_di_bruno(const Eigen::MatrixXd& Jf,
   unsigned int mg = Jg.rows();  
 
   // are they compatible ?
-  if(mg != nf) { /* problem !! */ }
+  if(mg != nf)
+    {
+      Rcpp::stop("the jacobian of g has %d rows but the jacobian of f has %d columns",mg,nf);
+    }
+  // the hessians are stacked side by side, one for each output
+  if(Hf.rows() != nf || Hf.cols() != mf*nf)
+    {
+      Rcpp::stop("the hessians of f should be %d x %d but are %d x %d",nf,mf*nf,Hf.rows(),Hf.cols());
+    }
+  if(Hg.rows() != ng || Hg.cols() != nf*ng)
+    {
+      Rcpp::stop("the hessians of g should be %d x %d but are %d x %d",ng,nf*ng,Hg.rows(),Hg.cols());
+    }
 
   // create the resulting Jacobian
   Eigen::MatrixXd Jfog = Jf*Jg;
 
-  // use faa di bruno's formula to obtain the (stacked) Hessian
+  // use faa di bruno's formula to obtain the (stacked) Hessian, for each output m
+  //   Hfog_m = Jg^T Hf_m Jg + sum_k Jf(m,k) Hg_k
   Eigen::MatrixXd Hfog(ng,mf*ng);
-  Hfog.fill(0);
 
-  // loop over all of the second order partial derivatives
-  for (unsigned int m = 0; m < mf; m++)
+  // the second terms for every output in one product - each stacked hessian is a column of the
+  // views of Hg and Hfog as (ng*ng) x nf and (ng*ng) x mf matrices
+  Eigen::Map<const Eigen::MatrixXd> Hg_flat(Hg.data(),ng*ng,nf);
+  Eigen::Map<Eigen::MatrixXd> Hfog_flat(Hfog.data(),ng*ng,mf);
+  Hfog_flat.noalias() = Hg_flat*Jf.transpose();
+
+  // add the first terms, the outputs are independent
+  #pragma omp parallel for schedule(dynamic)
+  for(int m = 0; m < (int) mf; m++)
     {
-      for(unsigned int i = 0; i < ng; i++)
-	{
-	  for(unsigned int j = 0; j < ng; j++)
-	    {
-	      for(unsigned int k = 0; k < nf; k++)
-		{
-		  Hfog(i,j+m*ng) = Hfog(i,j+m*ng) + Jf(m,k)*Hg(i,j+k*ng);
-		  for(unsigned int l = 0; l < nf; l++)
-		    {
-		      Hfog(i,j+m*ng) = Hfog(i,j+m*ng) + Hf(k,l+m*ng)*Jg(k,i)*Jg(l,j);		      
-		    }
-		}	   
-	    }
-	}
+      Eigen::MatrixXd Hf_m_Jg = Hf.block(0,m*nf,nf,nf)*Jg;
+      Hfog.block(0,m*ng,ng,ng).noalias() += Jg.transpose()*Hf_m_Jg;
     }
 
-  /*
-    for (unsigned int m = 0; m < mf; m++)
-    {
-      for(unsigned int i = 0; i < ng; i++)
-	{
-	  for(unsigned int j = 0; j < ng; j++)
-	    {
-	      for(unsigned int k = 0; k < nf; k++)
-		{
-		  Hfog(i,j+m*ng) = Hfog(i,j+m*ng) + Jf(m,k)*Hg(i,j+k*ng);
-		}	   
-	    }
-	}
-    } 
-  */
   return Rcpp::List::create(Rcpp::Named("Jfog") = Jfog,Rcpp::Named("Hfog") = Hfog);
 
   